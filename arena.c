@@ -0,0 +1,104 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGNMENT 16
+
+struct ArenaChunk
+{
+	ArenaChunk* next;
+	size_t size;
+	size_t used;
+	char* data;
+};
+
+static ArenaChunk* createChunk(size_t size);
+
+void ARENA_Init(Arena* arena, size_t size)
+{
+	arena->first = createChunk(size);
+	arena->current = arena->first;
+}
+
+void ARENA_Quit(Arena* arena)
+{
+	ArenaChunk* chunk = arena->first;
+	ArenaChunk* next = NULL;
+	while(chunk != NULL) {
+		next = chunk->next;
+		free(chunk->data);
+		free(chunk);
+		chunk = next;
+	}
+	arena->first = NULL;
+	arena->current = NULL;
+}
+
+/* When the current chunk is full the next one is used, so chunks added
+   for big allocations are reused after a reset. */
+void* ARENA_Alloc(Arena* arena, size_t size)
+{
+	ArenaChunk* chunk = arena->current;
+	ArenaChunk* new_chunk = NULL;
+	void* result = NULL;
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+	while(chunk->used + size > chunk->size) {
+		if(chunk->next == NULL) {
+			new_chunk = createChunk((size > chunk->size * 2) ? size : chunk->size * 2);
+			chunk->next = new_chunk;
+		}
+		chunk = chunk->next;
+		chunk->used = 0;
+	}
+	arena->current = chunk;
+	result = chunk->data + chunk->used;
+	chunk->used += size;
+	return result;
+}
+
+char* ARENA_Strdup(Arena* arena, const char* s)
+{
+	size_t len = strlen(s);
+	char* result = (char*)ARENA_Alloc(arena, len + 1);
+	memcpy(result, s, len + 1);
+	return result;
+}
+
+void ARENA_Reset(Arena* arena)
+{
+	arena->current = arena->first;
+	arena->first->used = 0;
+}
+
+static ArenaChunk* createChunk(size_t size)
+{
+	ArenaChunk* chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk));
+	chunk->data = (char*)malloc(size);
+	if(chunk->data == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		exit(-1);
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
@@ -0,0 +1,40 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaChunk ArenaChunk;
+
+/* Bump allocator for short-lived data. Everything allocated is freed
+   at once by ARENA_Reset, and the memory is kept for reuse. */
+typedef struct Arena
+{
+	ArenaChunk* first;
+	ArenaChunk* current;
+} Arena;
+
+void ARENA_Init(Arena* arena, size_t size);
+void ARENA_Quit(Arena* arena);
+
+void* ARENA_Alloc(Arena* arena, size_t size);
+char* ARENA_Strdup(Arena* arena, const char* s);
+void ARENA_Reset(Arena* arena);
+
+#endif
@@ -18,8 +18,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "arg.h"
+#include "crypt.h"
 #include "settings.h"
 
 struct Option
@@ -37,6 +39,28 @@ static int actionCommand(int id, char** argv, Settings* settings);
 static int keyCommand(int id, char** argv, Settings* settings);
 static int ignoreCommand(int id, char** argv, Settings* settings);
 static int verboseCommand(int id, char** argv, Settings* settings);
+static int jobsCommand(int id, char** argv, Settings* settings);
+static int rekeyCommand(int id, char** argv, Settings* settings);
+static int filesFromCommand(int id, char** argv, Settings* settings);
+static int nullCommand(int id, char** argv, Settings* settings);
+static int includeCommand(int id, char** argv, Settings* settings);
+static int excludeCommand(int id, char** argv, Settings* settings);
+static int minSizeCommand(int id, char** argv, Settings* settings);
+static int maxSizeCommand(int id, char** argv, Settings* settings);
+static int newerCommand(int id, char** argv, Settings* settings);
+static int olderCommand(int id, char** argv, Settings* settings);
+static int watchCommand(int id, char** argv, Settings* settings);
+static int cpusCommand(int id, char** argv, Settings* settings);
+static int numaCommand(int id, char** argv, Settings* settings);
+static int traceCommand(int id, char** argv, Settings* settings);
+static int outputDirCommand(int id, char** argv, Settings* settings);
+static int cipherCommand(int id, char** argv, Settings* settings);
+static int progressCommand(int id, char** argv, Settings* settings);
+static int chunksCommand(int id, char** argv, Settings* settings);
+
+static int copyKey(const char* key, uint8_t* dest, int* len);
+static int parseSize(const char* s, int64_t* size);
+static int parseTime(const char* s, int64_t* time);
 
 static struct Option options[] = {
 	{.short_name = 'h', .full_name = "help", .description = "display this help and exit", .func = helpCommand},
@@ -45,7 +69,25 @@ static struct Option options[] = {
 	{.short_name = 'a', .full_name = "action", .description = "set action (e - encrypt, d - decrypt)", .func = actionCommand},
 	{.short_name = 'k', .full_name = "key", .description = "set key", .func = keyCommand},
 	{.short_name = 'i', .full_name = "ignore", .description = "continue even if program fails to process some file", .func = ignoreCommand},
-	{.short_name = 'v', .full_name = "verbose", .description = "print more information", .func = verboseCommand}
+	{.short_name = 'v', .full_name = "verbose", .description = "print more information", .func = verboseCommand},
+	{.short_name = 'j', .full_name = "jobs", .description = "set number of files processed at once on each device", .func = jobsCommand},
+	{.short_name = 'R', .full_name = "rekey", .description = "change key of encrypted files to the given one", .func = rekeyCommand},
+	{.short_name = 'T', .full_name = "files-from", .description = "read names of files to process from FILE (- for stdin)", .func = filesFromCommand},
+	{.short_name = '0', .full_name = "null", .description = "names in --files-from are separated by null characters", .func = nullCommand},
+	{.full_name = "include", .description = "process only files matching PATTERN", .func = includeCommand},
+	{.full_name = "exclude", .description = "skip files and directories matching PATTERN", .func = excludeCommand},
+	{.full_name = "min-size", .description = "skip files smaller than SIZE (K, M, G suffixes allowed)", .func = minSizeCommand},
+	{.full_name = "max-size", .description = "skip files bigger than SIZE (K, M, G suffixes allowed)", .func = maxSizeCommand},
+	{.full_name = "newer", .description = "skip files modified before TIME (seconds or YYYY-MM-DD)", .func = newerCommand},
+	{.full_name = "older", .description = "skip files modified after TIME (seconds or YYYY-MM-DD)", .func = olderCommand},
+	{.short_name = 'w', .full_name = "watch", .description = "keep running and process files written to the directories", .func = watchCommand},
+	{.full_name = "cpus", .description = "run workers only on CPUs from LIST (e.g. 0-3,8)", .func = cpusCommand},
+	{.full_name = "numa", .description = "run workers on the NUMA node of their device", .func = numaCommand},
+	{.full_name = "trace", .description = "write timings of every file to FILE in Chrome trace format", .func = traceCommand},
+	{.short_name = 'o', .full_name = "output-dir", .description = "write results under DIR instead of replacing files", .func = outputDirCommand},
+	{.full_name = "cipher", .description = "encrypt with CIPHER (aes256-gcm by default, chacha20-poly1305, aes256-ctr, aes256-ecb or auto)", .func = cipherCommand},
+	{.full_name = "progress", .description = "show progress, speed and remaining time", .func = progressCommand},
+	{.full_name = "chunks", .description = "store file data as deduplicated chunks in DIR, leaving only recipes in place of files", .func = chunksCommand}
 };
 static const int options_num = sizeof(options) / sizeof(struct Option);
 static char** paths = NULL;
@@ -57,7 +99,7 @@ void ARG_Parse(int argc, char **argv, Settings* settings)
 	int len;
 	char is_option_found;
 	char *s;
-	paths = (char**)malloc(sizeof(char) * (argc - 1));
+	paths = (char**)malloc(sizeof(char*) * argc);
 	for(i = 1; i < argc;) {
 		s = argv[i];
 		if(s[0] == '-') {
@@ -142,7 +184,7 @@ static int helpCommand(int id, char** argv, Settings* settings)
 		if(options[i].short_name) {
 			printf("-%c, ", options[i].short_name);
 		} else {
-			printf("     ");
+			printf("    ");
 		}
 		printf("--%s", options[i].full_name);
 		j = 8 + strlen(options[i].full_name);
@@ -174,10 +216,13 @@ static int randomLevelCommand(int id, char** argv, Settings* settings)
 
 static int actionCommand(int id, char** argv, Settings* settings)
 {
-	int len = strlen(argv[id]);
-	char action = argv[id][0];
-	if((len > 1) || !((action == 'e') || (action == 'd'))) {
-		fprintf(stderr, "Unknown action: %s\n", argv[id]);
+	int len = (argv[id] != NULL) ? strlen(argv[id]) : 0;
+	char action = (argv[id] != NULL) ? argv[id][0] : '\0';
+	if((len != 1) || !((action == 'e') || (action == 'd'))) {
+		fprintf(stderr, "Unknown action: %s\n", argv[id] ? argv[id] : "");
+		return 0;
+	} else if(settings->is_rekey) {
+		fprintf(stderr, "Action can't be set together with --rekey\n");
 		return 0;
 	} else if(action == 'e') {
 		settings->is_encrypt = 1;
@@ -190,9 +235,10 @@ static int actionCommand(int id, char** argv, Settings* settings)
 
 static int keyCommand(int id, char** argv, Settings* settings)
 {
-	strcpy((char*)(settings->key), argv[id]);
+	if(!copyKey(argv[id], settings->key, &settings->key_len)) {
+		return 0;
+	}
 	settings->is_key_set = 1;
-	settings->key_len = strlen(argv[id]);
 	return id + 1;
 }
 
@@ -207,3 +253,224 @@ static int verboseCommand(int id, char** argv, Settings* settings)
 	settings->is_verbose = 1;
 	return id;
 }
+
+static int jobsCommand(int id, char** argv, Settings* settings)
+{
+	char* end = NULL;
+	long jobs = (argv[id] != NULL) ? strtol(argv[id], &end, 10) : 0;
+	if((argv[id] == NULL) || (*end != '\0') || (jobs < 1) || (jobs > 256)) {
+		fprintf(stderr, "Invalid number of jobs: %s\n", argv[id] ? argv[id] : "");
+		return 0;
+	} else {
+		settings->jobs_per_device = jobs;
+		return id + 1;
+	}
+}
+
+static int rekeyCommand(int id, char** argv, Settings* settings)
+{
+	if(settings->is_action_set && !settings->is_rekey) {
+		fprintf(stderr, "--rekey can't be used together with --action\n");
+		return 0;
+	}
+	if(!copyKey(argv[id], settings->new_key, &settings->new_key_len)) {
+		return 0;
+	}
+	settings->is_rekey = 1;
+	settings->is_encrypt = 0;
+	settings->is_action_set = 1;
+	return id + 1;
+}
+
+static int filesFromCommand(int id, char** argv, Settings* settings)
+{
+	if((argv[id] == NULL) || (argv[id][0] == '\0')) {
+		fprintf(stderr, "File list is not specified\n");
+		return 0;
+	}
+	settings->files_from = argv[id];
+	return id + 1;
+}
+
+static int nullCommand(int id, char** argv, Settings* settings)
+{
+	settings->is_null_delimited = 1;
+	return id;
+}
+
+static int includeCommand(int id, char** argv, Settings* settings)
+{
+	if(argv[id] == NULL) {
+		fprintf(stderr, "Pattern is not specified\n");
+		return 0;
+	}
+	settings->include_patterns = (char**)realloc(settings->include_patterns,
+	                                             sizeof(char*) * (settings->include_patterns_num + 1));
+	settings->include_patterns[settings->include_patterns_num++] = argv[id];
+	return id + 1;
+}
+
+static int excludeCommand(int id, char** argv, Settings* settings)
+{
+	if(argv[id] == NULL) {
+		fprintf(stderr, "Pattern is not specified\n");
+		return 0;
+	}
+	settings->exclude_patterns = (char**)realloc(settings->exclude_patterns,
+	                                             sizeof(char*) * (settings->exclude_patterns_num + 1));
+	settings->exclude_patterns[settings->exclude_patterns_num++] = argv[id];
+	return id + 1;
+}
+
+static int minSizeCommand(int id, char** argv, Settings* settings)
+{
+	return parseSize(argv[id], &settings->min_size) ? id + 1 : 0;
+}
+
+static int maxSizeCommand(int id, char** argv, Settings* settings)
+{
+	return parseSize(argv[id], &settings->max_size) ? id + 1 : 0;
+}
+
+static int newerCommand(int id, char** argv, Settings* settings)
+{
+	return parseTime(argv[id], &settings->min_mtime) ? id + 1 : 0;
+}
+
+static int olderCommand(int id, char** argv, Settings* settings)
+{
+	return parseTime(argv[id], &settings->max_mtime) ? id + 1 : 0;
+}
+
+static int watchCommand(int id, char** argv, Settings* settings)
+{
+	settings->is_watch = 1;
+	return id;
+}
+
+static int cpusCommand(int id, char** argv, Settings* settings)
+{
+	if((argv[id] == NULL) || (argv[id][0] == '\0')) {
+		fprintf(stderr, "CPU list is not specified\n");
+		return 0;
+	}
+	settings->cpus = argv[id];
+	return id + 1;
+}
+
+static int numaCommand(int id, char** argv, Settings* settings)
+{
+	settings->is_numa = 1;
+	return id;
+}
+
+static int traceCommand(int id, char** argv, Settings* settings)
+{
+	if((argv[id] == NULL) || (argv[id][0] == '\0')) {
+		fprintf(stderr, "Trace file is not specified\n");
+		return 0;
+	}
+	settings->trace_file = argv[id];
+	return id + 1;
+}
+
+static int outputDirCommand(int id, char** argv, Settings* settings)
+{
+	if((argv[id] == NULL) || (argv[id][0] == '\0')) {
+		fprintf(stderr, "Output directory is not specified\n");
+		return 0;
+	}
+	settings->output_dir = argv[id];
+	return id + 1;
+}
+
+static int cipherCommand(int id, char** argv, Settings* settings)
+{
+	int cipher = (argv[id] != NULL) ? CRYPT_FindCipher(argv[id]) : -1;
+	settings->is_cipher_set = 1;
+	if((argv[id] != NULL) && (strcmp(argv[id], "auto") == 0)) {
+		settings->is_cipher_auto = 1;
+		return id + 1;
+	} else if(cipher < 0) {
+		fprintf(stderr, "Unknown cipher: %s\n", argv[id] ? argv[id] : "");
+		return 0;
+	} else {
+		settings->is_cipher_auto = 0;
+		settings->cipher = cipher;
+		return id + 1;
+	}
+}
+
+static int progressCommand(int id, char** argv, Settings* settings)
+{
+	settings->is_progress = 1;
+	return id;
+}
+
+static int chunksCommand(int id, char** argv, Settings* settings)
+{
+	if((argv[id] == NULL) || (argv[id][0] == '\0')) {
+		fprintf(stderr, "Chunk store directory is not specified\n");
+		return 0;
+	}
+	settings->chunks_dir = argv[id];
+	return id + 1;
+}
+
+static int copyKey(const char* key, uint8_t* dest, int* len)
+{
+	if(key == NULL) {
+		fprintf(stderr, "Key is not specified\n");
+		return 0;
+	}
+	*len = strlen(key);
+	if(*len > MAX_KEY_LENGTH) {
+		fprintf(stderr, "Key is too long, at most %d characters are allowed\n", MAX_KEY_LENGTH);
+		*len = 0;
+		return 0;
+	}
+	memcpy(dest, key, *len + 1);
+	return 1;
+}
+
+static int parseSize(const char* s, int64_t* size)
+{
+	char* end = NULL;
+	long long value = (s != NULL) ? strtoll(s, &end, 10) : -1;
+	if((s != NULL) && (end != s) && (value >= 0)) {
+		switch(*end) {
+		case 'G':
+			value *= 1024;
+		case 'M':
+			value *= 1024;
+		case 'K':
+			value *= 1024;
+			++end;
+		}
+		if(*end == '\0') {
+			*size = value;
+			return 1;
+		}
+	}
+	fprintf(stderr, "Invalid size: %s\n", s ? s : "");
+	return 0;
+}
+
+static int parseTime(const char* s, int64_t* time)
+{
+	char* end = NULL;
+	struct tm tm;
+	long long value = (s != NULL) ? strtoll(s, &end, 10) : -1;
+	if((s != NULL) && (end != s) && (*end == '\0') && (value >= 0)) {
+		*time = value;
+		return 1;
+	}
+	memset(&tm, 0, sizeof(tm));
+	if((s != NULL) && ((end = strptime(s, "%Y-%m-%d", &tm)) != NULL) && (*end == '\0')) {
+		tm.tm_isdst = -1;
+		*time = mktime(&tm);
+		return 1;
+	}
+	fprintf(stderr, "Invalid time: %s\n", s ? s : "");
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "chunk.h"
+#include "crypt.h"
+#include "format.h"
+#include "settings.h"
+
+/* A chunk ends where the top 16 bits of the rolling hash are zero,
+   which gives 64 KiB chunks on average. */
+#define BOUNDARY_MASK 0xffff000000000000ULL
+/* Seed of the gear table. Like the chunk sizes it must never change. */
+#define GEAR_SEED 0x6469726372797074ULL
+#define CHUNK_ID_SIZE 32
+
+static Settings* settings = NULL;
+static uint64_t gear[256];
+static int64_t new_chunks_num = 0;
+static int64_t old_chunks_num = 0;
+
+static void getChunkPath(const uint8_t* id, char* path);
+static void loadStoreKey();
+static void rekeyStoreKey();
+static int readStoreKey(uint8_t* data);
+static int unwrapStoreKey(const uint8_t* data, int is_new_key, uint8_t* secret);
+static int writeStoreKey(const uint8_t* data, int is_replace);
+
+/* Chunks are kept in 256 directories named after the first byte of
+   their id. */
+void CHUNK_Init(Settings* _settings)
+{
+	uint64_t x = GEAR_SEED;
+	uint64_t z;
+	char path[PATH_MAX];
+	int i;
+
+	settings = _settings;
+	for(i = 0; i < 256; ++i) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+	if(settings->chunks_dir == NULL) {
+		return;
+	}
+	if(settings->is_rekey) {
+		rekeyStoreKey();
+		return;
+	}
+	if(!settings->is_encrypt) {
+		if(access(settings->chunks_dir, R_OK) != 0) {
+			fprintf(stderr, "Failed to open chunk store %s\n", settings->chunks_dir);
+			exit(-1);
+		}
+		return;
+	}
+	if((mkdir(settings->chunks_dir, 0777) != 0) && (errno != EEXIST)) {
+		fprintf(stderr, "Failed to create %s\n", settings->chunks_dir);
+		exit(-1);
+	}
+	for(i = 0; i < 256; ++i) {
+		snprintf(path, PATH_MAX, "%s/%02x", settings->chunks_dir, i);
+		if((mkdir(path, 0777) != 0) && (errno != EEXIST)) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			exit(-1);
+		}
+	}
+	loadStoreKey();
+}
+
+void CHUNK_Quit()
+{
+	if((settings != NULL) && (settings->chunks_dir != NULL) && settings->is_encrypt && settings->is_verbose) {
+		printf("Chunks: %lld new, %lld already stored\n", (long long)new_chunks_num, (long long)old_chunks_num);
+	}
+}
+
+/* Returns the size of the chunk at the start of data. Unless data
+   holds the rest of the file, it must hold at least MAX_CHUNK_SIZE
+   bytes, so that the end doesn't depend on how the file is read. */
+int CHUNK_FindEnd(const uint8_t* data, int size)
+{
+	uint64_t hash = 0;
+	int i;
+	if(size <= MIN_CHUNK_SIZE) {
+		return size;
+	}
+	if(size > MAX_CHUNK_SIZE) {
+		size = MAX_CHUNK_SIZE;
+	}
+	for(i = MIN_CHUNK_SIZE; i < size; ++i) {
+		hash = (hash << 1) + gear[data[i]];
+		if((hash & BOUNDARY_MASK) == 0) {
+			return i + 1;
+		}
+	}
+	return size;
+}
+
+/* Writes the chunk to the store unless it is already there and
+   returns its key. The data is encrypted in place. Workers storing the
+   same chunk at once write their own temporary files, and whichever is
+   renamed last wins. */
+int CHUNK_Store(uint8_t* data, int size, uint8_t* key)
+{
+	uint8_t id[CHUNK_ID_SIZE];
+	uint8_t tag[CHUNK_TAG_SIZE];
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 32];
+	FILE* file = NULL;
+	int result = 0;
+
+	CRYPT_GetChunkKey(data, size, key);
+	CRYPT_GetChunkId(key, id);
+	getChunkPath(id, path);
+	if(access(path, F_OK) == 0) {
+		__atomic_add_fetch(&old_chunks_num, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	CRYPT_EncryptChunk(data, size, key, tag);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld~", path, (long)syscall(SYS_gettid));
+	file = fopen(tmp_path, "w");
+	if(file == NULL) {
+		return -1;
+	}
+	if((fwrite(data, sizeof(uint8_t), size, file) != size)
+	   || (fwrite(tag, sizeof(uint8_t), CHUNK_TAG_SIZE, file) != CHUNK_TAG_SIZE)) {
+		result = -1;
+	}
+	if(fclose(file) != 0) {
+		result = -1;
+	}
+	if((result != 0) || (rename(tmp_path, path) != 0)) {
+		remove(tmp_path);
+		return -1;
+	}
+	__atomic_add_fetch(&new_chunks_num, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Reads and decrypts the chunk with the given key. Returns -1 if it is
+   missing or damaged. */
+int CHUNK_Load(const uint8_t* key, uint8_t* data, int size)
+{
+	uint8_t id[CHUNK_ID_SIZE];
+	uint8_t tag[CHUNK_TAG_SIZE];
+	char path[PATH_MAX];
+	FILE* file = NULL;
+	int len;
+
+	CRYPT_GetChunkId(key, id);
+	getChunkPath(id, path);
+	file = fopen(path, "r");
+	if(file == NULL) {
+		return -1;
+	}
+	len = fread(data, sizeof(uint8_t), size, file);
+	len += fread(tag, sizeof(uint8_t), CHUNK_TAG_SIZE, file);
+	fclose(file);
+	if(len != size + CHUNK_TAG_SIZE) {
+		return -1;
+	}
+	return CRYPT_DecryptChunk(data, size, key, tag);
+}
+
+static void getChunkPath(const uint8_t* id, char* path)
+{
+	int i;
+	int len = snprintf(path, PATH_MAX, "%s/%02x/", settings->chunks_dir, id[0]);
+	for(i = 0; (i < CHUNK_ID_SIZE) && (len + 2 < PATH_MAX); ++i) {
+		len += snprintf(path + len, PATH_MAX - len, "%02x", id[i]);
+	}
+}
+
+/* The first run which stores chunks creates the secret. Runs started at
+   the same time link their key files into place, and the losers use the
+   one which got there first. */
+static void loadStoreKey()
+{
+	uint8_t data[STORE_KEY_FILE_SIZE];
+	uint8_t secret[KEY_SIZE];
+	int result;
+	for(;;) {
+		result = readStoreKey(data);
+		if(result == 0) {
+			if(unwrapStoreKey(data, 0, secret) != 0) {
+				fprintf(stderr, "Chunk store %s uses another key\n", settings->chunks_dir);
+				exit(-1);
+			}
+			break;
+		} else if(result != -ENOENT) {
+			fprintf(stderr, "Failed to read key of chunk store %s\n", settings->chunks_dir);
+			exit(-1);
+		}
+		CRYPT_GenerateKey(secret, KEY_SIZE);
+		memcpy(data, STORE_KEY_MAGIC, HEADER_MAGIC_SIZE);
+		memcpy(data + HEADER_MAGIC_SIZE, secret, KEY_SIZE);
+		CRYPT_Encrypt(data + HEADER_MAGIC_SIZE, KEY_SIZE);
+		CRYPT_GetChunkId(secret, data + HEADER_MAGIC_SIZE + KEY_SIZE);
+		result = writeStoreKey(data, 0);
+		if(result == 0) {
+			break;
+		} else if(result != -EEXIST) {
+			fprintf(stderr, "Failed to write key of chunk store %s\n", settings->chunks_dir);
+			exit(-1);
+		}
+	}
+	CRYPT_SetChunkHashKey(secret);
+}
+
+/* A store which already has the new key was changed by an earlier run
+   over another part of the tree. */
+static void rekeyStoreKey()
+{
+	uint8_t data[STORE_KEY_FILE_SIZE];
+	uint8_t secret[KEY_SIZE];
+	int result = readStoreKey(data);
+	if(result == -ENOENT) {
+		return;
+	} else if(result != 0) {
+		fprintf(stderr, "Failed to read key of chunk store %s\n", settings->chunks_dir);
+		exit(-1);
+	}
+	if(unwrapStoreKey(data, 0, secret) == 0) {
+		CRYPT_RewrapKey(data + HEADER_MAGIC_SIZE, KEY_SIZE);
+		if(writeStoreKey(data, 1) != 0) {
+			fprintf(stderr, "Failed to write key of chunk store %s\n", settings->chunks_dir);
+			exit(-1);
+		}
+	} else if(unwrapStoreKey(data, 1, secret) != 0) {
+		fprintf(stderr, "Chunk store %s uses another key\n", settings->chunks_dir);
+		exit(-1);
+	}
+}
+
+/* Returns -ENOENT if the store has no key yet. */
+static int readStoreKey(uint8_t* data)
+{
+	char path[PATH_MAX];
+	FILE* file = NULL;
+	int len;
+	snprintf(path, PATH_MAX, "%s/key", settings->chunks_dir);
+	file = fopen(path, "r");
+	if(file == NULL) {
+		return (errno == ENOENT) ? -ENOENT : -1;
+	}
+	len = fread(data, sizeof(uint8_t), STORE_KEY_FILE_SIZE, file);
+	fclose(file);
+	if((len != STORE_KEY_FILE_SIZE) || (memcmp(data, STORE_KEY_MAGIC, HEADER_MAGIC_SIZE) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int unwrapStoreKey(const uint8_t* data, int is_new_key, uint8_t* secret)
+{
+	uint8_t check[KEY_SIZE];
+	memcpy(secret, data + HEADER_MAGIC_SIZE, KEY_SIZE);
+	if(is_new_key) {
+		CRYPT_DecryptWithNewKey(secret, KEY_SIZE);
+	} else {
+		CRYPT_Decrypt(secret, KEY_SIZE);
+	}
+	CRYPT_GetChunkId(secret, check);
+	return (memcmp(check, data + HEADER_MAGIC_SIZE + KEY_SIZE, KEY_SIZE) == 0) ? 0 : -1;
+}
+
+/* Returns -EEXIST if a new key lost the race to another one. */
+static int writeStoreKey(const uint8_t* data, int is_replace)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 32];
+	FILE* file = NULL;
+	int result = 0;
+	snprintf(path, PATH_MAX, "%s/key", settings->chunks_dir);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld~", path, (long)getpid());
+	file = fopen(tmp_path, "w");
+	if(file == NULL) {
+		return -1;
+	}
+	if(fwrite(data, sizeof(uint8_t), STORE_KEY_FILE_SIZE, file) != STORE_KEY_FILE_SIZE) {
+		result = -1;
+	}
+	if(fclose(file) != 0) {
+		result = -1;
+	}
+	if(result == 0) {
+		if(is_replace) {
+			result = (rename(tmp_path, path) == 0) ? 0 : -1;
+		} else if(link(tmp_path, path) != 0) {
+			result = (errno == EEXIST) ? -EEXIST : -1;
+		}
+	}
+	if((result != 0) || !is_replace) {
+		remove(tmp_path);
+	}
+	return result;
+}
@@ -16,11 +16,15 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define GCRYPT_NO_DEPRECATED
 #include <gcrypt.h>
 
 #include "crypt.h"
+#include "format.h"
 #include "settings.h"
 
 #define GCRY_CHECK(a)							\
@@ -32,10 +36,44 @@
 	}											\
 	}
 
-static gcry_cipher_hd_t cipher_handle;
+/* Data encrypted by CRYPT_SelectCipher to compare ciphers. */
+#define BENCHMARK_SIZE (256 * 1024)
+#define BENCHMARK_ROUNDS 3
+
+typedef struct Cipher
+{
+	const char* name;
+	int algorithm;
+	int mode;
+	int tag_size;
+} Cipher;
+
+static const Cipher ciphers[CRYPT_CIPHERS_NUM] = {
+	{"aes256-ecb", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0},
+	{"aes256-ctr", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CTR, 0},
+	{"aes256-gcm", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 16},
+	{"chacha20-poly1305", GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, 16}
+};
+
+static __thread gcry_cipher_hd_t cipher_handle;
+static __thread gcry_cipher_hd_t data_handle;
+static __thread int data_cipher;
+static __thread gcry_cipher_hd_t new_key_handle;
+static __thread gcry_cipher_hd_t chunk_handle;
+static __thread gcry_md_hd_t chunk_hash_handle;
 static gcry_md_hd_t hash_handle;
 static gcry_random_level_t random_level = GCRY_STRONG_RANDOM;
 uint8_t key_hash[32];
+static uint8_t cipher_key[32];
+static int cipher_key_len = 0;
+static uint8_t new_key_hash[32];
+static uint8_t new_cipher_key[32];
+static int new_cipher_key_len = 0;
+static uint8_t chunk_hash_key[KEY_SIZE];
+
+static void deriveKey(uint8_t* key, int key_len, uint8_t* cipher_key, uint8_t* key_hash);
+static void setBlockNonce(const uint8_t* nonce, int64_t block_id, int last_block_size);
+static void addToNonce(const uint8_t* nonce, uint64_t value, int size, uint8_t* result);
 
 void CRYPT_Init()
 {
@@ -44,19 +82,45 @@ void CRYPT_Init()
 	}
 	GCRY_CHECK(gcry_control(GCRYCTL_DISABLE_SECMEM, 0));
 	GCRY_CHECK(gcry_control(GCRYCTL_INITIALIZATION_FINISHED));
-	GCRY_CHECK(gcry_cipher_open(&cipher_handle, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0));
+	CRYPT_InitThread();
 	GCRY_CHECK(gcry_md_open(&hash_handle, GCRY_MD_SHA256, 0));
 }
 
 void CRYPT_Quit()
 {
 	gcry_md_close(hash_handle);
+	CRYPT_QuitThread();
+}
+
+/* Every thread gets its own cipher handles, keyed with the keys
+   derived in CRYPT_ReadSettings. */
+void CRYPT_InitThread()
+{
+	GCRY_CHECK(gcry_cipher_open(&cipher_handle, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0));
+	GCRY_CHECK(gcry_cipher_open(&data_handle, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0));
+	data_cipher = CRYPT_CIPHER_AES256_ECB;
+	GCRY_CHECK(gcry_cipher_open(&new_key_handle, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0));
+	GCRY_CHECK(gcry_cipher_open(&chunk_handle, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 0));
+	GCRY_CHECK(gcry_md_open(&chunk_hash_handle, GCRY_MD_BLAKE2B_256, 0));
+	if(cipher_key_len > 0) {
+		CRYPT_SetKey(cipher_key, cipher_key_len);
+	}
+	if(new_cipher_key_len > 0) {
+		GCRY_CHECK(gcry_cipher_setkey(new_key_handle, new_cipher_key, new_cipher_key_len));
+	}
+}
+
+void CRYPT_QuitThread()
+{
+	gcry_md_close(chunk_hash_handle);
+	gcry_cipher_close(chunk_handle);
+	gcry_cipher_close(new_key_handle);
+	gcry_cipher_close(data_handle);
 	gcry_cipher_close(cipher_handle);
 }
 
 void CRYPT_ReadSettings(Settings* settings)
 {
-	uint8_t* tmp_hash = NULL;
 	switch(settings->random_level) {
 	case 1:
 		random_level = GCRY_WEAK_RANDOM;
@@ -72,14 +136,26 @@ void CRYPT_ReadSettings(Settings* settings)
 		break;
 	}
 
-	tmp_hash = CRYPT_Hash((settings->key), settings->key_len);
-	CRYPT_SetKey(tmp_hash, 32);
-	memcpy(key_hash, tmp_hash, 32);
-	tmp_hash = CRYPT_Hash(key_hash, 32);
-	memcpy(key_hash, tmp_hash, 32);
+	deriveKey(settings->key, settings->key_len, cipher_key, key_hash);
+	cipher_key_len = 32;
+	CRYPT_SetKey(cipher_key, cipher_key_len);
 	if(settings->is_encrypt) {
 		CRYPT_Encrypt(key_hash, 32);
 	}
+
+	if(settings->is_rekey) {
+		deriveKey(settings->new_key, settings->new_key_len, new_cipher_key, new_key_hash);
+		new_cipher_key_len = 32;
+		GCRY_CHECK(gcry_cipher_setkey(new_key_handle, new_cipher_key, new_cipher_key_len));
+		GCRY_CHECK(gcry_cipher_encrypt(new_key_handle, new_key_hash, 32, NULL, 0));
+	}
+
+	if(settings->is_encrypt && settings->is_cipher_auto) {
+		settings->cipher = CRYPT_SelectCipher();
+		if(settings->is_verbose) {
+			printf("Using %s cipher\n", CRYPT_GetCipherName(settings->cipher));
+		}
+	}
 }
 
 void CRYPT_Decrypt(uint8_t* data, int size)
@@ -102,6 +178,175 @@ uint8_t* CRYPT_GetKeyHash()
 	return key_hash;
 }
 
+uint8_t* CRYPT_GetNewKeyHash()
+{
+	return new_key_hash;
+}
+
+int CRYPT_FindCipher(const char* name)
+{
+	int i;
+	for(i = 0; i < CRYPT_CIPHERS_NUM; ++i) {
+		if(strcmp(name, ciphers[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* CRYPT_GetCipherName(int cipher)
+{
+	return ciphers[cipher].name;
+}
+
+int CRYPT_GetTagSize(int cipher)
+{
+	return ciphers[cipher].tag_size;
+}
+
+/* Encrypts some data with both authenticated ciphers and returns the
+   faster one. Without AES instructions this is ChaCha20. */
+int CRYPT_SelectCipher()
+{
+	static const int candidates[] = {CRYPT_CIPHER_AES256_GCM, CRYPT_CIPHER_CHACHA20_POLY1305};
+	uint8_t key[KEY_SIZE];
+	uint8_t nonce[NONCE_SIZE];
+	uint8_t tag[MAX_TAG_SIZE];
+	uint8_t* data = (uint8_t*)malloc(BENCHMARK_SIZE);
+	struct timespec start, end;
+	int64_t time, best_time = -1;
+	int best_cipher = CRYPT_CIPHER_AES256_GCM;
+	int i, j, k, cipher;
+
+	memset(key, 0, KEY_SIZE);
+	memset(nonce, 0, NONCE_SIZE);
+	memset(data, 0, BENCHMARK_SIZE);
+	for(i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); ++i) {
+		cipher = candidates[i];
+		CRYPT_SetDataCipher(cipher);
+		CRYPT_SetDataKey(key, KEY_SIZE);
+		for(j = 0; j < BENCHMARK_ROUNDS; ++j) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for(k = 0; k < BENCHMARK_SIZE / BLOCK_SIZE; ++k) {
+				CRYPT_EncryptData(data + k * BLOCK_SIZE, BLOCK_SIZE, nonce, k, -1, tag);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			time = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+			if((best_time < 0) || (time < best_time)) {
+				best_time = time;
+				best_cipher = cipher;
+			}
+		}
+	}
+	free(data);
+	return best_cipher;
+}
+
+/* Blocks are encrypted separately, each with its own nonce, so that
+   they can be decrypted in any order. last_block_size is given for the
+   last block of the file and is -1 for the others. Returns -1 if the
+   tag doesn't match. */
+int CRYPT_DecryptData(uint8_t* data, int size, const uint8_t* nonce, int64_t block_id,
+                      int last_block_size, const uint8_t* tag)
+{
+	int tag_size = ciphers[data_cipher].tag_size;
+	setBlockNonce(nonce, block_id, last_block_size);
+	GCRY_CHECK(gcry_cipher_decrypt(data_handle, data, size, NULL, 0));
+	if((tag_size > 0) && (gcry_cipher_checktag(data_handle, tag, tag_size) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+void CRYPT_EncryptData(uint8_t* data, int size, const uint8_t* nonce, int64_t block_id,
+                       int last_block_size, uint8_t* tag)
+{
+	int tag_size = ciphers[data_cipher].tag_size;
+	setBlockNonce(nonce, block_id, last_block_size);
+	GCRY_CHECK(gcry_cipher_encrypt(data_handle, data, size, NULL, 0));
+	if(tag_size > 0) {
+		GCRY_CHECK(gcry_cipher_gettag(data_handle, tag, tag_size));
+	}
+}
+
+void CRYPT_SetDataCipher(int cipher)
+{
+	if(cipher != data_cipher) {
+		gcry_cipher_close(data_handle);
+		GCRY_CHECK(gcry_cipher_open(&data_handle, ciphers[cipher].algorithm, ciphers[cipher].mode, 0));
+		data_cipher = cipher;
+	}
+}
+
+void CRYPT_SetDataKey(uint8_t* data, int size)
+{
+	GCRY_CHECK(gcry_cipher_setkey(data_handle, data, size));
+}
+
+void CRYPT_GenerateKey(uint8_t* data, int size)
+{
+	if(random_level == GCRY_WEAK_RANDOM) {
+		gcry_randomize(data, size, GCRY_STRONG_RANDOM);
+	} else {
+		gcry_randomize(data, size, random_level);
+	}
+}
+
+void CRYPT_DecryptWithNewKey(uint8_t* data, int size)
+{
+	GCRY_CHECK(gcry_cipher_decrypt(new_key_handle, data, size, NULL, 0));
+}
+
+/* Data key wrapped with the user key becomes wrapped with the new key. */
+void CRYPT_RewrapKey(uint8_t* data, int size)
+{
+	CRYPT_Decrypt(data, size);
+	GCRY_CHECK(gcry_cipher_encrypt(new_key_handle, data, size, NULL, 0));
+}
+
+/* Chunks are encrypted with a key computed from their contents and the
+   secret of the chunk store, so equal chunks are encrypted the same way
+   and can be stored once. Stored chunks are named by a hash of the key.
+   A key only ever encrypts the same data, so the nonce can be fixed. */
+void CRYPT_SetChunkHashKey(const uint8_t* key)
+{
+	memcpy(chunk_hash_key, key, KEY_SIZE);
+}
+
+void CRYPT_GetChunkKey(const uint8_t* data, int size, uint8_t* key)
+{
+	gcry_md_reset(chunk_hash_handle);
+	GCRY_CHECK(gcry_md_setkey(chunk_hash_handle, chunk_hash_key, KEY_SIZE));
+	gcry_md_write(chunk_hash_handle, data, size);
+	memcpy(key, gcry_md_read(chunk_hash_handle, GCRY_MD_BLAKE2B_256), KEY_SIZE);
+}
+
+void CRYPT_GetChunkId(const uint8_t* key, uint8_t* id)
+{
+	gcry_md_hash_buffer(GCRY_MD_SHA256, id, key, KEY_SIZE);
+}
+
+void CRYPT_EncryptChunk(uint8_t* data, int size, const uint8_t* key, uint8_t* tag)
+{
+	uint8_t nonce[12];
+	memset(nonce, 0, sizeof(nonce));
+	GCRY_CHECK(gcry_cipher_setkey(chunk_handle, key, KEY_SIZE));
+	GCRY_CHECK(gcry_cipher_setiv(chunk_handle, nonce, sizeof(nonce)));
+	GCRY_CHECK(gcry_cipher_encrypt(chunk_handle, data, size, NULL, 0));
+	GCRY_CHECK(gcry_cipher_gettag(chunk_handle, tag, CHUNK_TAG_SIZE));
+}
+
+/* Returns -1 if the tag doesn't match. */
+int CRYPT_DecryptChunk(uint8_t* data, int size, const uint8_t* key, const uint8_t* tag)
+{
+	uint8_t nonce[12];
+	memset(nonce, 0, sizeof(nonce));
+	GCRY_CHECK(gcry_cipher_setkey(chunk_handle, key, KEY_SIZE));
+	GCRY_CHECK(gcry_cipher_setiv(chunk_handle, nonce, sizeof(nonce)));
+	GCRY_CHECK(gcry_cipher_decrypt(chunk_handle, data, size, NULL, 0));
+	return (gcry_cipher_checktag(chunk_handle, tag, CHUNK_TAG_SIZE) == 0) ? 0 : -1;
+}
+
 void CRYPT_FillWithNoise(uint8_t* data, int size)
 {
 	gcry_randomize(data, size, random_level);
@@ -112,3 +357,63 @@ uint8_t* CRYPT_Hash(uint8_t* data, int size)
 	gcry_md_write(hash_handle, data, size);
 	return gcry_md_read(hash_handle, GCRY_MD_SHA256);
 }
+
+static void deriveKey(uint8_t* key, int key_len, uint8_t* cipher_key, uint8_t* key_hash)
+{
+	uint8_t* tmp_hash = NULL;
+	gcry_md_reset(hash_handle);
+	tmp_hash = CRYPT_Hash(key, key_len);
+	memcpy(cipher_key, tmp_hash, 32);
+	memcpy(key_hash, tmp_hash, 32);
+	tmp_hash = CRYPT_Hash(key_hash, 32);
+	memcpy(key_hash, tmp_hash, 32);
+}
+
+/* In CTR mode the counter of a block continues the counter of the
+   previous one, AEAD modes take a 12 byte nonce per block. The nonce of
+   the last block has its top bit flipped, and the header fields which
+   are fixed for the file are authenticated with every block, together
+   with the size of the last block in that block. So dropping blocks
+   from the end or changing the header makes the tags fail. */
+static void setBlockNonce(const uint8_t* nonce, int64_t block_id, int last_block_size)
+{
+	uint8_t block_nonce[NONCE_SIZE];
+	uint8_t aad[HEADER_MAGIC_SIZE + 2 * sizeof(uint32_t) + NONCE_SIZE];
+	uint32_t value;
+	switch(ciphers[data_cipher].mode) {
+	case GCRY_CIPHER_MODE_ECB:
+		break;
+	case GCRY_CIPHER_MODE_CTR:
+		addToNonce(nonce, block_id * (BLOCK_SIZE / 16), 16, block_nonce);
+		GCRY_CHECK(gcry_cipher_setctr(data_handle, block_nonce, 16));
+		break;
+	default:
+		addToNonce(nonce, block_id, 12, block_nonce);
+		if(last_block_size >= 0) {
+			block_nonce[0] ^= 0x80;
+		}
+		GCRY_CHECK(gcry_cipher_setiv(data_handle, block_nonce, 12));
+		memcpy(aad, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+		value = data_cipher;
+		memcpy(aad + HEADER_MAGIC_SIZE, &value, sizeof(uint32_t));
+		memcpy(aad + HEADER_MAGIC_SIZE + sizeof(uint32_t), nonce, NONCE_SIZE);
+		value = last_block_size;
+		memcpy(aad + HEADER_MAGIC_SIZE + sizeof(uint32_t) + NONCE_SIZE, &value, sizeof(uint32_t));
+		GCRY_CHECK(gcry_cipher_authenticate(data_handle, aad,
+		                                    (last_block_size >= 0) ? sizeof(aad) : sizeof(aad) - sizeof(uint32_t)));
+		break;
+	}
+}
+
+/* Adds value to the first size bytes of nonce, read as a big endian
+   number. */
+static void addToNonce(const uint8_t* nonce, uint64_t value, int size, uint8_t* result)
+{
+	int i;
+	memcpy(result, nonce, size);
+	for(i = size - 1; (i >= 0) && (value != 0); --i) {
+		value += result[i];
+		result[i] = value & 0xff;
+		value >>= 8;
+	}
+}
@@ -22,8 +22,21 @@
 
 typedef struct Settings Settings;
 
+/* Ciphers for file data. The id is stored in the file header, so the
+   values must not change. */
+enum
+{
+	CRYPT_CIPHER_AES256_ECB = 0,
+	CRYPT_CIPHER_AES256_CTR = 1,
+	CRYPT_CIPHER_AES256_GCM = 2,
+	CRYPT_CIPHER_CHACHA20_POLY1305 = 3,
+	CRYPT_CIPHERS_NUM
+};
+
 void CRYPT_Init();
 void CRYPT_Quit();
+void CRYPT_InitThread();
+void CRYPT_QuitThread();
 
 void CRYPT_ReadSettings(Settings* settings);
 
@@ -31,6 +44,28 @@ void CRYPT_Decrypt(uint8_t* data, int size);
 void CRYPT_Encrypt(uint8_t* data, int size);
 void CRYPT_SetKey(uint8_t* data, int size);
 uint8_t* CRYPT_GetKeyHash();
+uint8_t* CRYPT_GetNewKeyHash();
+
+int CRYPT_FindCipher(const char* name);
+const char* CRYPT_GetCipherName(int cipher);
+int CRYPT_GetTagSize(int cipher);
+int CRYPT_SelectCipher();
+
+int CRYPT_DecryptData(uint8_t* data, int size, const uint8_t* nonce, int64_t block_id,
+                      int last_block_size, const uint8_t* tag);
+void CRYPT_EncryptData(uint8_t* data, int size, const uint8_t* nonce, int64_t block_id,
+                       int last_block_size, uint8_t* tag);
+void CRYPT_SetDataCipher(int cipher);
+void CRYPT_SetDataKey(uint8_t* data, int size);
+void CRYPT_GenerateKey(uint8_t* data, int size);
+void CRYPT_DecryptWithNewKey(uint8_t* data, int size);
+void CRYPT_RewrapKey(uint8_t* data, int size);
+
+void CRYPT_SetChunkHashKey(const uint8_t* key);
+void CRYPT_GetChunkKey(const uint8_t* data, int size, uint8_t* key);
+void CRYPT_GetChunkId(const uint8_t* key, uint8_t* id);
+void CRYPT_EncryptChunk(uint8_t* data, int size, const uint8_t* key, uint8_t* tag);
+int CRYPT_DecryptChunk(uint8_t* data, int size, const uint8_t* key, const uint8_t* tag);
 
 void CRYPT_FillWithNoise(uint8_t* data, int size);
 
@@ -19,20 +19,30 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
-#include <ftw.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
 
+#include "arena.h"
+#include "chunk.h"
 #include "crypt.h"
 #include "fedi.h"
+#include "format.h"
+#include "progress.h"
 #include "settings.h"
+#include "trace.h"
+#include "watch.h"
 
-#define BLOCK_SIZE 1024
+#define IO_BUFFER_SIZE 65536
+/* Enough for the names of a file, so the arena rarely needs to grow. */
+#define ARENA_SIZE (4 * PATH_MAX)
 
 #define SAFE_CALL(a) \
 if(a != 0) {                            \
-    closeFiles(0, &state);              \
+    closeFiles(0, state);               \
     if(!settings->is_ignore_errors) {   \
         return -1;                      \
     } else {                            \
@@ -40,6 +50,14 @@ if(a != 0) {                            \
     }                                   \
 }
 
+#define TRACE_STAGE(name, bytes, a) \
+do {                                    \
+	TRACE_Begin(name, NULL);            \
+	result = a;                         \
+	TRACE_End(name, bytes, result);     \
+	SAFE_CALL(result)                   \
+} while(0)
+
 #define SAFE_READ(data, data_size, n, file)                        \
 if(fread(data, data_size, n, file) != n) {                         \
 	fprintf(stderr, "%s - ailed to read data!", state->file_name); \
@@ -52,55 +70,207 @@ if(fwrite(data, data_size, n, file) != n) {                        \
     return -1;                                                     \
 }
 
-typedef struct State
+struct State
 {
 	FILE* file_in;
 	FILE* file_out;
 	char* file_name;
 	char* tmp_file_name;
+	char* out_file_name;
+	char out_dir[PATH_MAX];
+	Arena arena;
 	uint32_t last_block_size;
-} State;
+	int64_t data_size;
+	char is_legacy_format;
+	char is_recipe;
+	int header_size;
+	uint32_t cipher;
+	int tag_size;
+	uint8_t wrapped_key[KEY_SIZE];
+	uint8_t nonce[NONCE_SIZE];
+	uint64_t file_size;
+	uint64_t chunks_num;
+	uint8_t block1[BLOCK_SIZE + MAX_TAG_SIZE + 1];
+	uint8_t block2[BLOCK_SIZE + MAX_TAG_SIZE + 1];
+	char in_buffer[IO_BUFFER_SIZE];
+	char out_buffer[IO_BUFFER_SIZE];
+	State* next;
+};
 
-State state;
+static State* states = NULL;
+static pthread_mutex_t states_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static Settings* settings = NULL;
 static char* prog_path = NULL;
 static char* working_dir = NULL;
+/* Whether the output paths came from absolute names or from relative
+   ones going the given number of levels above the working directory. */
+static int output_names_kind = 0;
+static volatile int is_stopped = 0;
 
 static void fillWorkingDir();
-static char* getRealPath(const char* file_name);
-static int isProgFile(const char* file_name);
+static char* getRealPath(Arena* arena, const char* file_name);
+static int isProgFile(State* state, const char* file_name);
 
+static int isEncrypted(State* state);
+static int readFileHeader(State* state);
+static int writeFileHeader(State* state, FILE* file, uint8_t* key_hash);
 static int processFileHeader(int is_finishing, State* state);
+static void createDataKey(State* state, int cipher);
+static int rekeyFile(const char* file_name, State* state);
+static int writeRecipe(State* state);
+static int readRecipe(State* state);
+static int processFile(State* state, const char* file_name);
+static char* getOutputPath(State* state, const char* file_name);
+static int makeParentDirs(const char* path, State* state);
 static int processFileData(State* state);
 static int openFiles(const char* file_name, State* state);
 static int closeFiles(int is_replace_old_file, State* state);
-static int callback(const char *file_name, const struct stat *s, int type);
+static void initState(State* state);
 
 void FEDI_Init(char* prog_name, Settings* _settings)
 {
+	Arena arena;
 	settings = _settings;
 	fillWorkingDir();
-	prog_path = getRealPath(prog_name);
-	state.file_in = NULL;
-	state.file_out = NULL;
-	state.file_name = NULL;
-	state.tmp_file_name = NULL;
-	state.last_block_size = 0;
+	ARENA_Init(&arena, ARENA_SIZE);
+	prog_path = strdup(getRealPath(&arena, prog_name));
+	ARENA_Quit(&arena);
 }
 
 void FEDI_Quit()
 {
-	closeFiles(0, &state);
-	free(state.tmp_file_name);
-	free(state.file_name);
+	State* state = states;
+	State* next = NULL;
+	while(state != NULL) {
+		next = state->next;
+		closeFiles(0, state);
+		ARENA_Quit(&state->arena);
+		free(state);
+		state = next;
+	}
+	states = NULL;
 	free(prog_path);
 	free(working_dir);
 }
 
-void FEDI_ProcessPath(char* path)
+/* Files being processed are given up at the next block and their
+   temporary files are removed, as after an error. */
+void FEDI_Stop()
+{
+	is_stopped = 1;
+}
+
+/* Every worker thread processes files with its own state. States are
+   kept in a list so that FEDI_Quit can clean up after all of them.
+   The state is cleared by the thread which uses it, so its buffers end
+   up in the memory of that thread's NUMA node. */
+State* FEDI_CreateState()
+{
+	State* state = (State*)malloc(sizeof(State));
+	memset(state, 0, sizeof(State));
+	initState(state);
+	pthread_mutex_lock(&states_lock);
+	state->next = states;
+	states = state;
+	pthread_mutex_unlock(&states_lock);
+	return state;
+}
+
+void FEDI_DestroyState(State* state)
 {
-	ftw(path, callback, 1);
+	State** it = NULL;
+	pthread_mutex_lock(&states_lock);
+	for(it = &states; *it != NULL; it = &(*it)->next) {
+		if(*it == state) {
+			*it = state->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&states_lock);
+	closeFiles(0, state);
+	ARENA_Quit(&state->arena);
+	free(state);
+}
+
+int FEDI_ProcessFile(State* state, const char* file_name)
+{
+	int result;
+	ARENA_Reset(&state->arena);
+	if(!settings->is_encrypt_all && isProgFile(state, file_name)) {
+		return 0;
+	}
+
+	TRACE_Begin("file", file_name);
+	state->data_size = 0;
+	result = processFile(state, file_name);
+	TRACE_End("file", state->data_size, result);
+	return result;
+}
+
+static void initState(State* state)
+{
+	state->file_in = NULL;
+	state->file_out = NULL;
+	state->file_name = NULL;
+	state->tmp_file_name = NULL;
+	state->out_file_name = NULL;
+	state->out_dir[0] = '\0';
+	ARENA_Init(&state->arena, ARENA_SIZE);
+	state->last_block_size = 0;
+	state->data_size = 0;
+	state->is_legacy_format = 0;
+	state->is_recipe = 0;
+	state->header_size = HEADER_SIZE;
+	state->cipher = CRYPT_CIPHER_AES256_ECB;
+	state->tag_size = 0;
+}
+
+static int processFile(State* state, const char* file_name)
+{
+	const char* header_stage = settings->is_encrypt ? "header write" : "header read";
+	int result;
+
+	if(settings->is_rekey) {
+		TRACE_STAGE("rekey", HEADER_SIZE, rekeyFile(file_name, state));
+		if(settings->is_verbose) {
+			printf("Changing key: %s - ok!\n", file_name);
+		}
+		return 0;
+	}
+
+	TRACE_Begin("open", NULL);
+	result = openFiles(file_name, state);
+	TRACE_End("open", 0, (result < 0) ? result : 0);
+	if(result > 0) {
+		if(settings->is_verbose) {
+			printf("Skipping: %s - already encrypted with this key\n", file_name);
+		}
+		return 0;
+	}
+	SAFE_CALL(result)
+	if(settings->is_encrypt && (settings->chunks_dir != NULL)) {
+		TRACE_STAGE("chunks", state->data_size, writeRecipe(state));
+	} else {
+		TRACE_STAGE(header_stage, HEADER_SIZE, processFileHeader(0, state));
+		if(state->is_recipe) {
+			TRACE_STAGE("chunks", state->data_size, readRecipe(state));
+		} else {
+			TRACE_STAGE("data", state->data_size, processFileData(state));
+		}
+		if(settings->is_encrypt) {
+			TRACE_STAGE("header write", HEADER_SIZE, processFileHeader(1, state));
+		}
+	}
+
+	if((closeFiles(1, state) != 0) && !settings->is_ignore_errors) {
+		return -1;
+	}
+
+	if(settings->is_verbose) {
+		printf("Processing: %s - ok!\n", file_name);
+	}
+	return 0;
 }
 
 static void fillWorkingDir()
@@ -116,81 +286,355 @@ static void fillWorkingDir()
 	free(path);
 }
 
-static char* getRealPath(const char* file_name)
+/* Relative names are resolved against the working directory, absolute
+   ones are taken as they are. */
+static char* getRealPath(Arena* arena, const char* file_name)
 {
-	int name_len = strlen(file_name);
-	int path_len = strlen(working_dir);
 	char* path = NULL;
 	char* full_path = NULL;
-	path = (char*)malloc(sizeof(char) * (path_len + name_len + 1));
-	if(file_name[0] != '/') {
-		path = (char*)malloc(sizeof(char) * (path_len + name_len + 1));
-		strcpy(path, working_dir);
-		strcat(path, file_name);
-		full_path = realpath(path, NULL);
-		strcpy(path, full_path);
-		free(full_path);
-		return path;
-	} else {
-		strcpy(path, file_name);
+	if(file_name[0] == '/') {
+		return ARENA_Strdup(arena, file_name);
+	}
+	path = (char*)ARENA_Alloc(arena, strlen(working_dir) + strlen(file_name) + 1);
+	strcpy(path, working_dir);
+	strcat(path, file_name);
+	full_path = (char*)ARENA_Alloc(arena, PATH_MAX);
+	if(realpath(path, full_path) == NULL) {
 		return path;
 	}
+	return full_path;
 }
 
-static int isProgFile(const char* file_name)
+static int isProgFile(State* state, const char* file_name)
 {
-	char* full_file_name = getRealPath(file_name);
-	if(strcmp(full_file_name, prog_path) == 0) {
-		free(full_file_name);
-		return 1;
-	} else {
-		free(full_file_name);
+	return strcmp(getRealPath(&state->arena, file_name), prog_path) == 0;
+}
+
+/* A name may come twice, from a list or another run, and encrypting it
+   again would bury the data under a second header. */
+static int isEncrypted(State* state)
+{
+	uint8_t* key_hash = CRYPT_GetKeyHash();
+	uint8_t header[HEADER_MAGIC_SIZE + sizeof(uint32_t) + KEY_HASH_SIZE];
+	uint8_t* real_key_hash = NULL;
+	size_t len = fread(header, sizeof(uint8_t), sizeof(header), state->file_in);
+	rewind(state->file_in);
+	if(len < HEADER_MAGIC_SIZE) {
+		return 0;
+	}
+	if(memcmp(header, RECIPE_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		real_key_hash = header + HEADER_MAGIC_SIZE;
+	} else if((memcmp(header, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0)
+	          || (memcmp(header, HEADER_MAGIC_V2, HEADER_MAGIC_SIZE) == 0)) {
+		real_key_hash = header + HEADER_MAGIC_SIZE + sizeof(uint32_t);
+	}
+	if((real_key_hash == NULL) || (real_key_hash + KEY_HASH_SIZE > header + len)) {
 		return 0;
 	}
+	/* When encrypting, the key check is kept in the form it is written. */
+	return (memcmp(key_hash, real_key_hash, KEY_HASH_SIZE) == 0);
 }
 
-static int processFileHeader(int is_finishing, State* state)
+static int readFileHeader(State* state)
 {
 	uint8_t* key_hash = CRYPT_GetKeyHash();
 	FILE* file_in = state->file_in;
-	FILE* file_out = state->file_out;
-	static uint8_t real_key_hash[32];
+	uint8_t real_key_hash[32];
+	char magic[HEADER_MAGIC_SIZE];
+
+	SAFE_READ(magic, sizeof(char), HEADER_MAGIC_SIZE, file_in);
+	state->cipher = CRYPT_CIPHER_AES256_ECB;
+	state->is_recipe = 0;
+	if(memcmp(magic, RECIPE_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		state->is_legacy_format = 0;
+		state->is_recipe = 1;
+		state->header_size = RECIPE_HEADER_SIZE;
+		state->cipher = CRYPT_CIPHER_AES256_GCM;
+	} else if(memcmp(magic, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		state->is_legacy_format = 0;
+		state->header_size = HEADER_SIZE;
+		SAFE_READ(&(state->last_block_size), sizeof(uint32_t), 1, file_in);
+	} else if(memcmp(magic, HEADER_MAGIC_V2, HEADER_MAGIC_SIZE) == 0) {
+		state->is_legacy_format = 0;
+		state->header_size = HEADER_SIZE_V2;
+		SAFE_READ(&(state->last_block_size), sizeof(uint32_t), 1, file_in);
+	} else {
+		state->is_legacy_format = 1;
+		state->header_size = LEGACY_HEADER_SIZE;
+		memcpy(&(state->last_block_size), magic, sizeof(uint32_t));
+	}
+	SAFE_READ(real_key_hash, sizeof(uint8_t), 32, file_in);
+	CRYPT_Decrypt(real_key_hash, 32);
+	if(memcmp(key_hash, real_key_hash, 32) != 0) {
+		fprintf(stderr, "%s - Incorrect key!\n", state->file_name);
+		return -1;
+	}
+	if(!state->is_legacy_format) {
+		SAFE_READ(state->wrapped_key, sizeof(uint8_t), KEY_SIZE, file_in);
+	}
+	if(state->is_recipe) {
+		SAFE_READ(state->nonce, sizeof(uint8_t), NONCE_SIZE, file_in);
+		SAFE_READ(&(state->file_size), sizeof(uint64_t), 1, file_in);
+		SAFE_READ(&(state->chunks_num), sizeof(uint64_t), 1, file_in);
+		state->tag_size = RECIPE_TAG_SIZE;
+		return 0;
+	}
+	if(state->header_size == HEADER_SIZE) {
+		SAFE_READ(&(state->cipher), sizeof(uint32_t), 1, file_in);
+		SAFE_READ(state->nonce, sizeof(uint8_t), NONCE_SIZE, file_in);
+		if(state->cipher >= CRYPT_CIPHERS_NUM) {
+			fprintf(stderr, "%s - Unknown cipher!\n", state->file_name);
+			return -1;
+		}
+	}
+	if(state->last_block_size > BLOCK_SIZE) {
+		fprintf(stderr, "%s - Data is corrupted!\n", state->file_name);
+		return -1;
+	}
+	state->tag_size = CRYPT_GetTagSize(state->cipher);
+	return 0;
+}
+
+static int writeFileHeader(State* state, FILE* file, uint8_t* key_hash)
+{
+	const char* magic = (state->header_size == HEADER_SIZE) ? HEADER_MAGIC : HEADER_MAGIC_V2;
+	fseek(file, 0, SEEK_SET);
+	if(state->is_recipe) {
+		SAFE_WRITE(RECIPE_MAGIC, sizeof(char), HEADER_MAGIC_SIZE, file);
+		SAFE_WRITE(key_hash, sizeof(uint8_t), 32, file);
+		SAFE_WRITE(state->wrapped_key, sizeof(uint8_t), KEY_SIZE, file);
+		SAFE_WRITE(state->nonce, sizeof(uint8_t), NONCE_SIZE, file);
+		SAFE_WRITE(&(state->file_size), sizeof(uint64_t), 1, file);
+		SAFE_WRITE(&(state->chunks_num), sizeof(uint64_t), 1, file);
+		return 0;
+	}
+	SAFE_WRITE(magic, sizeof(char), HEADER_MAGIC_SIZE, file);
+	SAFE_WRITE(&(state->last_block_size), sizeof(uint32_t), 1, file);
+	SAFE_WRITE(key_hash, sizeof(uint8_t), 32, file);
+	SAFE_WRITE(state->wrapped_key, sizeof(uint8_t), KEY_SIZE, file);
+	if(state->header_size == HEADER_SIZE) {
+		SAFE_WRITE(&(state->cipher), sizeof(uint32_t), 1, file);
+		SAFE_WRITE(state->nonce, sizeof(uint8_t), NONCE_SIZE, file);
+	}
+	return 0;
+}
+
+/* Each file's data is encrypted with its own random key and nonce.
+   The key is stored in the header encrypted with the user key, next to
+   the cipher, so files are decrypted with the cipher they were
+   encrypted with. */
+static int processFileHeader(int is_finishing, State* state)
+{
+	uint8_t data_key[KEY_SIZE];
 
 	if(settings->is_encrypt) {
-		fseek(file_out, 0, SEEK_SET);
-		SAFE_WRITE(&(state->last_block_size), sizeof(uint32_t), 1, file_out);
-		SAFE_WRITE(key_hash, sizeof(uint8_t), 32, file_out);
+		if(!is_finishing) {
+			createDataKey(state, settings->cipher);
+			state->header_size = HEADER_SIZE;
+		}
+		return writeFileHeader(state, state->file_out, CRYPT_GetKeyHash());
 	} else if(!is_finishing) {
-		SAFE_READ(&(state->last_block_size), sizeof(uint32_t), 1, file_in);
-		SAFE_READ(real_key_hash, sizeof(uint8_t), 32, file_in);
-		CRYPT_Decrypt(real_key_hash, 32);
-		if(memcmp(key_hash, real_key_hash, 32) != 0) {
-			fprintf(stderr, "%s - Incorrect key!\n", state->file_name);
-			fflush(file_out);
+		if(readFileHeader(state) != 0) {
+			return -1;
+		}
+		if(!state->is_legacy_format) {
+			memcpy(data_key, state->wrapped_key, KEY_SIZE);
+			CRYPT_Decrypt(data_key, KEY_SIZE);
+			CRYPT_SetDataCipher(state->cipher);
+			CRYPT_SetDataKey(data_key, KEY_SIZE);
+		}
+	}
+	return 0;
+}
+
+static void createDataKey(State* state, int cipher)
+{
+	uint8_t data_key[KEY_SIZE];
+	state->cipher = cipher;
+	state->tag_size = CRYPT_GetTagSize(cipher);
+	CRYPT_GenerateKey(data_key, KEY_SIZE);
+	CRYPT_GenerateKey(state->nonce, NONCE_SIZE);
+	CRYPT_SetDataCipher(cipher);
+	CRYPT_SetDataKey(data_key, KEY_SIZE);
+	memcpy(state->wrapped_key, data_key, KEY_SIZE);
+	CRYPT_Encrypt(state->wrapped_key, KEY_SIZE);
+	state->is_legacy_format = 0;
+}
+
+/* Only the wrapped data key and the key check in the header change,
+   so the file is updated in place. */
+static int rekeyFile(const char* file_name, State* state)
+{
+	state->file_name = ARENA_Strdup(&state->arena, file_name);
+	state->file_in = fopen(file_name, "r+");
+	if(!state->file_in) {
+		fprintf(stderr, "Failed to open file %s\n", file_name);
+		return -1;
+	}
+	if(readFileHeader(state) != 0) {
+		return -1;
+	}
+	if(state->is_legacy_format) {
+		fprintf(stderr, "%s - File has old format, decrypt and encrypt it again to change the key\n", file_name);
+		return -1;
+	}
+	CRYPT_RewrapKey(state->wrapped_key, KEY_SIZE);
+	if(writeFileHeader(state, state->file_in, CRYPT_GetNewKeyHash()) != 0) {
+		return -1;
+	}
+	return closeFiles(0, state);
+}
+
+/* With a chunk store the file is replaced by its recipe, the list of
+   its chunks. Data is read so that at least MAX_CHUNK_SIZE bytes are
+   buffered before each chunk, and chunks which the store already has
+   are only hashed. Entries are encrypted with the recipe's own data
+   key, as blocks of a file are. */
+static int writeRecipe(State* state)
+{
+	uint8_t* buffer = (uint8_t*)ARENA_Alloc(&state->arena, 2 * MAX_CHUNK_SIZE);
+	uint8_t entry[RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE];
+	uint8_t trailer[RECIPE_TRAILER_SIZE + RECIPE_TAG_SIZE];
+	uint32_t chunk_size;
+	int len = 0, pos = 0, read_len = 0;
+	char is_eof = 0;
+
+	createDataKey(state, CRYPT_CIPHER_AES256_GCM);
+	state->is_recipe = 1;
+	state->header_size = RECIPE_HEADER_SIZE;
+	state->file_size = 0;
+	state->chunks_num = 0;
+	if(writeFileHeader(state, state->file_out, CRYPT_GetKeyHash()) != 0) {
+		return -1;
+	}
+	while(!is_stopped) {
+		if(!is_eof && (len - pos < MAX_CHUNK_SIZE)) {
+			memmove(buffer, buffer + pos, len - pos);
+			len -= pos;
+			pos = 0;
+			read_len = fread(buffer + len, sizeof(uint8_t), 2 * MAX_CHUNK_SIZE - len, state->file_in);
+			if(ferror(state->file_in)) {
+				fprintf(stderr, "%s - Failed to read data!\n", state->file_name);
+				return -1;
+			}
+			is_eof = (read_len < 2 * MAX_CHUNK_SIZE - len);
+			len += read_len;
+			state->data_size += read_len;
+			PROGRESS_AddBytes(read_len);
+		}
+		if(pos == len) {
+			break;
+		}
+		chunk_size = CHUNK_FindEnd(buffer + pos, len - pos);
+		memset(entry, 0, RECIPE_ENTRY_SIZE);
+		if(CHUNK_Store(buffer + pos, chunk_size, entry) != 0) {
+			fprintf(stderr, "%s - Failed to store chunk!\n", state->file_name);
+			return -1;
+		}
+		memcpy(entry + KEY_SIZE, &chunk_size, sizeof(uint32_t));
+		CRYPT_EncryptData(entry, RECIPE_ENTRY_SIZE, state->nonce, state->chunks_num, -1, entry + RECIPE_ENTRY_SIZE);
+		SAFE_WRITE(entry, sizeof(uint8_t), RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE, state->file_out);
+		state->file_size += chunk_size;
+		++state->chunks_num;
+		pos += chunk_size;
+	}
+	if(is_stopped) {
+		return -1;
+	}
+	memcpy(trailer, &(state->file_size), sizeof(uint64_t));
+	memcpy(trailer + sizeof(uint64_t), &(state->chunks_num), sizeof(uint64_t));
+	CRYPT_EncryptData(trailer, RECIPE_TRAILER_SIZE, state->nonce, state->chunks_num,
+	                  RECIPE_TRAILER_SIZE, trailer + RECIPE_TRAILER_SIZE);
+	SAFE_WRITE(trailer, sizeof(uint8_t), RECIPE_TRAILER_SIZE + RECIPE_TAG_SIZE, state->file_out);
+	return writeFileHeader(state, state->file_out, CRYPT_GetKeyHash());
+}
+
+/* The trailer must decrypt as the last block and repeat the header, so
+   a recipe with lost or reordered entries or an edited header fails. */
+static int readRecipe(State* state)
+{
+	uint8_t* buffer = (uint8_t*)ARENA_Alloc(&state->arena, MAX_CHUNK_SIZE);
+	uint8_t entry[RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE];
+	uint8_t trailer[RECIPE_TRAILER_SIZE + RECIPE_TAG_SIZE];
+	uint32_t chunk_size;
+	uint64_t i, size = 0;
+
+	if(settings->chunks_dir == NULL) {
+		fprintf(stderr, "%s - File is stored as chunks, use --chunks to restore it\n", state->file_name);
+		return -1;
+	}
+	for(i = 0; i < state->chunks_num; ++i) {
+		if(is_stopped) {
+			return -1;
+		}
+		SAFE_READ(entry, sizeof(uint8_t), RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE, state->file_in);
+		state->data_size += RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE;
+		PROGRESS_AddBytes(RECIPE_ENTRY_SIZE + RECIPE_TAG_SIZE);
+		if(CRYPT_DecryptData(entry, RECIPE_ENTRY_SIZE, state->nonce, i, -1, entry + RECIPE_ENTRY_SIZE) != 0) {
+			fprintf(stderr, "%s - Data is corrupted!\n", state->file_name);
+			return -1;
+		}
+		memcpy(&chunk_size, entry + KEY_SIZE, sizeof(uint32_t));
+		if((chunk_size > MAX_CHUNK_SIZE) || (CHUNK_Load(entry, buffer, chunk_size) != 0)) {
+			fprintf(stderr, "%s - Failed to restore chunk %llu!\n", state->file_name, (unsigned long long)i);
 			return -1;
 		}
+		SAFE_WRITE(buffer, sizeof(uint8_t), chunk_size, state->file_out);
+		size += chunk_size;
+	}
+	SAFE_READ(trailer, sizeof(uint8_t), RECIPE_TRAILER_SIZE + RECIPE_TAG_SIZE, state->file_in);
+	if((CRYPT_DecryptData(trailer, RECIPE_TRAILER_SIZE, state->nonce, state->chunks_num,
+	                      RECIPE_TRAILER_SIZE, trailer + RECIPE_TRAILER_SIZE) != 0)
+	   || (memcmp(trailer, &(state->file_size), sizeof(uint64_t)) != 0)
+	   || (memcmp(trailer + sizeof(uint64_t), &(state->chunks_num), sizeof(uint64_t)) != 0)
+	   || (size != state->file_size)) {
+		fprintf(stderr, "%s - Data is corrupted!\n", state->file_name);
+		return -1;
 	}
 	return 0;
 }
 
 static int processFileData(State* state)
 {
-	static uint8_t block1[BLOCK_SIZE + 1];
-	static uint8_t block2[BLOCK_SIZE + 1];
-	int len1 = fread(block1, sizeof(uint8_t), BLOCK_SIZE, state->file_in);
+	uint8_t* block1 = state->block1;
+	uint8_t* block2 = state->block2;
+	int tag_size = state->tag_size;
+	int in_block_size = settings->is_encrypt ? BLOCK_SIZE : BLOCK_SIZE + tag_size;
+	int len1 = fread(block1, sizeof(uint8_t), in_block_size, state->file_in);
 	int len2 = 0;
 	int cur_block_id = 0;
-	while(len1) {
-		len2 = fread(block2, sizeof(uint8_t), BLOCK_SIZE, state->file_in);
+	/* With an AEAD cipher even an empty file gets a block, which carries
+	   the last block mark, so a file can't lose all its blocks either. */
+	char is_block_required = (tag_size > 0);
+	if(!settings->is_encrypt && is_block_required && (len1 == 0)) {
+		fprintf(stderr, "%s - Data is corrupted!\n", state->file_name);
+		return -1;
+	}
+	while(len1 || (is_block_required && (cur_block_id == 0))) {
+		if(is_stopped) {
+			return -1;
+		}
+		len2 = fread(block2, sizeof(uint8_t), in_block_size, state->file_in);
+		state->data_size += len1;
+		PROGRESS_AddBytes(len1);
 		if(settings->is_encrypt) {
 			if(len2 == 0) {
+				TRACE_Begin("noise", NULL);
 				CRYPT_FillWithNoise(block1 + len1, BLOCK_SIZE - len1);
+				TRACE_End("noise", BLOCK_SIZE - len1, 0);
 			}
-			CRYPT_Encrypt(block1, BLOCK_SIZE);
-			SAFE_WRITE(block1, sizeof(uint8_t), BLOCK_SIZE, state->file_out);
+			CRYPT_EncryptData(block1, BLOCK_SIZE, state->nonce, cur_block_id,
+			                  (len2 == 0) ? len1 : -1, block1 + BLOCK_SIZE);
+			SAFE_WRITE(block1, sizeof(uint8_t), BLOCK_SIZE + tag_size, state->file_out);
 			state->last_block_size = len1;
 		} else {
-			CRYPT_Decrypt(block1, BLOCK_SIZE);
+			if(state->is_legacy_format) {
+				CRYPT_Decrypt(block1, BLOCK_SIZE);
+			} else if(CRYPT_DecryptData(block1, BLOCK_SIZE, state->nonce, cur_block_id,
+			                            (len2 == 0) ? (int)state->last_block_size : -1, block1 + BLOCK_SIZE) != 0) {
+				fprintf(stderr, "%s - Data is corrupted!\n", state->file_name);
+				return -1;
+			}
 			if(len2 != 0) {
 				SAFE_WRITE(block1, sizeof(uint8_t), BLOCK_SIZE, state->file_out);
 			} else {
@@ -204,70 +648,213 @@ static int processFileData(State* state)
 	return 0;
 }
 
+/* Without an output directory the result is written next to the file
+   and replaces it, otherwise it goes to the same path under that
+   directory. The temporary file is created exclusively, so two workers
+   given the same name never write it together. Returns 1 if the file is
+   already encrypted with this key. */
 static int openFiles(const char* file_name, State* state)
 {
-	int file_name_len = strlen(file_name);
-	state->file_name = (char*)malloc(sizeof(char) * (file_name_len + 1));
-	state->tmp_file_name = (char*)malloc(sizeof(char) * (file_name_len + 2));
-	strcpy(state->file_name, file_name);
-	strcpy(state->tmp_file_name, file_name);
+	const char* out_file_name = file_name;
+	int out_file_name_len;
+	int result;
+	int fd;
+	state->file_name = ARENA_Strdup(&state->arena, file_name);
+	if(settings->output_dir != NULL) {
+		state->out_file_name = getOutputPath(state, file_name);
+		if(state->out_file_name == NULL) {
+			return -1;
+		}
+		out_file_name = state->out_file_name;
+	}
+	out_file_name_len = strlen(out_file_name);
+	state->tmp_file_name = (char*)ARENA_Alloc(&state->arena, out_file_name_len + 2);
+	strcpy(state->tmp_file_name, out_file_name);
 	strcat(state->tmp_file_name, "~");
 
-	if(access(file_name, R_OK | W_OK) != 0) {
-		fprintf(stderr, "Error: don't have read/write access to %s\n", file_name);
+	TRACE_Begin("stat", NULL);
+	result = access(file_name, (settings->output_dir != NULL) ? R_OK : (R_OK | W_OK));
+	TRACE_End("stat", 0, result);
+	if(result != 0) {
+		fprintf(stderr, "Error: don't have %s access to %s\n",
+		        (settings->output_dir != NULL) ? "read" : "read/write", file_name);
+		return -1;
+	}
+	if((state->out_file_name != NULL) && (makeParentDirs(state->out_file_name, state) != 0)) {
+		fprintf(stderr, "Failed to create directory for %s\n", state->out_file_name);
 		return -1;
 	}
 	state->file_in = fopen(state->file_name, "r");
-	state->file_out = fopen(state->tmp_file_name, "w");
-	if(!state->file_in || !state->file_out) {
+	if(!state->file_in) {
+		printf("Failed to open file %s\n", file_name);
+		return -1;
+	}
+	if(settings->is_encrypt && isEncrypted(state)) {
+		fclose(state->file_in);
+		state->file_in = NULL;
+		state->file_name = NULL;
+		state->tmp_file_name = NULL;
+		state->out_file_name = NULL;
+		return 1;
+	}
+	fd = open(state->tmp_file_name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if((fd < 0) && (errno == EEXIST)) {
+		fprintf(stderr, "Error: %s exists, the file is being processed or a previous run was interrupted\n",
+		        state->tmp_file_name);
+		/* It isn't ours to remove. */
+		state->tmp_file_name = NULL;
+		return -1;
+	}
+	state->file_out = (fd >= 0) ? fdopen(fd, "w") : NULL;
+	if(!state->file_out) {
+		if(fd >= 0) {
+			close(fd);
+		}
 		printf("Failed to open file %s\n", file_name);
 		return -1;
 	}
+	setvbuf(state->file_in, state->in_buffer, _IOFBF, IO_BUFFER_SIZE);
+	setvbuf(state->file_out, state->out_buffer, _IOFBF, IO_BUFFER_SIZE);
 	return 0;
 }
 
 static int closeFiles(int is_replace_old_file, State* state)
 {
-	if(((state->file_in != NULL) && (state->file_out != NULL))
-	   && (fclose(state->file_in) || fclose(state->file_out))) {
+	struct stat s;
+	int is_signed = 0;
+	int result = 0;
+	TRACE_Begin("close", NULL);
+	if(state->file_in != NULL) {
+		result |= fclose(state->file_in);
+		state->file_in = NULL;
+	}
+	if(state->file_out != NULL) {
+		/* The watcher must know the file it is about to see renamed into
+		   place, so the result is taken from the descriptor, not the path. */
+		if(settings->is_watch && is_replace_old_file && (state->out_file_name == NULL)
+		   && (fflush(state->file_out) == 0) && (fstat(fileno(state->file_out), &s) == 0)) {
+			is_signed = 1;
+		}
+		result |= fclose(state->file_out);
+		state->file_out = NULL;
+	}
+	TRACE_End("close", 0, result);
+	if(result != 0) {
 		fprintf(stderr, "Failed to close file %s\n", state->file_name);
 		return -1;
 	}
 	if((state->file_name != NULL) && (state->tmp_file_name != NULL)) {
-		if(is_replace_old_file) {
-			remove(state->file_name);
-			rename(state->tmp_file_name, state->file_name);
+		if(is_replace_old_file && (state->out_file_name != NULL)) {
+			TRACE_Begin("rename", NULL);
+			result = rename(state->tmp_file_name, state->out_file_name);
+			TRACE_End("rename", 0, result);
+		} else if(is_replace_old_file) {
+			/* rename() replaces the file at once, so the name never
+			   goes missing for a moment. */
+			TRACE_Begin("rename", NULL);
+			result = rename(state->tmp_file_name, state->file_name);
+			TRACE_End("rename", 0, result);
+			if(is_signed && (result == 0)) {
+				WATCH_SetSignature(state->file_name, &s);
+			}
 		} else {
 			remove(state->tmp_file_name);
 		}
-		free(state->file_name);
-		free(state->tmp_file_name);
-		state->file_name = NULL;
-		state->tmp_file_name = NULL;
 	}
+	state->file_name = NULL;
+	state->tmp_file_name = NULL;
+	state->out_file_name = NULL;
 	return 0;
 }
 
-static int callback(const char *file_name, const struct stat *s, int type)
+/* The name is normalized and put under the output directory. The levels
+   a relative name goes above the working directory are dropped, so
+   "../data/f" lands in "data/f", while ".." in an absolute name stops at
+   the root. Names of one kind never share a result, but "/x/f", "x/f" and
+   "../x/f" would, so a run can't mix kinds. */
+static char* getOutputPath(State* state, const char* file_name)
 {
-	if((type == FTW_F) && !isProgFile(file_name)) {
-		if(settings->is_verbose) {
-			printf("Processing: %s - ", file_name);
-			fflush(stdout);
+	int dir_len = strlen(settings->output_dir);
+	int is_absolute = (file_name[0] == '/');
+	int levels_up = 0;
+	int kind;
+	int expected_kind = 0;
+	const char* name = file_name;
+	char* path = NULL;
+	char* start = NULL;
+	char* end = NULL;
+	int len;
+
+	path = (char*)ARENA_Alloc(&state->arena, dir_len + strlen(file_name) + 2);
+	strcpy(path, settings->output_dir);
+	if((dir_len == 0) || (path[dir_len - 1] != '/')) {
+		path[dir_len++] = '/';
+	}
+	start = path + dir_len;
+	end = start;
+	while(*name != '\0') {
+		for(len = 0; (name[len] != '\0') && (name[len] != '/'); ++len) {
 		}
+		if((len == 2) && (strncmp(name, "..", 2) == 0)) {
+			if(end > start) {
+				for(--end; (end > start) && (end[-1] != '/'); --end) {
+				}
+			} else if(!is_absolute) {
+				++levels_up;
+			}
+		} else if((len > 0) && !((len == 1) && (name[0] == '.'))) {
+			memcpy(end, name, len);
+			end += len;
+			*end++ = '/';
+		}
+		name += len;
+		while(*name == '/') {
+			++name;
+		}
+	}
+	if(end == start) {
+		fprintf(stderr, "Error: %s - name has no file part\n", file_name);
+		return NULL;
+	}
+	end[-1] = '\0';
 
-		SAFE_CALL(openFiles(file_name, &state));
-		SAFE_CALL(processFileHeader(0, &state));
-		SAFE_CALL(processFileData(&state));
-		SAFE_CALL(processFileHeader(1, &state));
+	kind = is_absolute ? 1 : (levels_up + 2);
+	if(!__atomic_compare_exchange_n(&output_names_kind, &expected_kind, kind, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+	   && (expected_kind != kind)) {
+		fprintf(stderr, "Error: %s - names from different levels above the working directory or absolute and relative names can't be mixed with --output-dir\n", file_name);
+		return NULL;
+	}
+	return path;
+}
 
-		if((closeFiles(1, &state) != 0) && !settings->is_ignore_errors) {
+/* Files mostly come grouped by directory, so the last created one is
+   remembered to skip the mkdir calls. */
+static int makeParentDirs(const char* path, State* state)
+{
+	char* dir = ARENA_Strdup(&state->arena, path);
+	char* slash = strrchr(dir, '/');
+	char* p = NULL;
+	if(slash == NULL) {
+		return 0;
+	}
+	*slash = '\0';
+	if(strcmp(state->out_dir, dir) == 0) {
+		return 0;
+	}
+	for(p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/')) {
+		if(p != NULL) {
+			*p = '\0';
+		}
+		if((mkdir(dir, 0777) != 0) && (errno != EEXIST)) {
 			return -1;
 		}
-
-		if(settings->is_verbose) {
-			puts("ok!");
+		if(p == NULL) {
+			break;
 		}
+		*p = '/';
+	}
+	if(strlen(dir) < PATH_MAX) {
+		strcpy(state->out_dir, dir);
 	}
 	return 0;
 }
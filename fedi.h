@@ -19,9 +19,13 @@
 #define FEDI_H
 
 typedef struct Settings Settings;
+typedef struct State State;
 
 void FEDI_Init(char* prog_name, Settings* settings);
-void FEDI_ProcessPath(char* path);
+State* FEDI_CreateState();
+void FEDI_DestroyState(State* state);
+int FEDI_ProcessFile(State* state, const char* file_name);
+void FEDI_Stop();
 void FEDI_Quit();
 
 #endif
@@ -0,0 +1,255 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "arg.h"
+#include "filter.h"
+#include "settings.h"
+
+/* Patterns are sorted out once so that most of them are checked
+   with a plain string comparison instead of fnmatch. */
+typedef enum PatternType
+{
+	PATTERN_LITERAL,
+	PATTERN_PREFIX,
+	PATTERN_SUFFIX,
+	PATTERN_GLOB
+} PatternType;
+
+typedef struct Pattern
+{
+	PatternType type;
+	char is_full_path;
+	const char* text;
+	int len;
+} Pattern;
+
+typedef struct PatternList
+{
+	Pattern* patterns;
+	int patterns_num;
+} PatternList;
+
+static Settings* settings = NULL;
+static char is_output_dir_set = 0;
+static struct stat output_dir;
+static char is_chunks_dir_set = 0;
+static struct stat chunks_dir;
+static PatternList include_list = {NULL, 0};
+static PatternList exclude_list = {NULL, 0};
+static const char** roots = NULL;
+static int* root_lens = NULL;
+static int roots_num = 0;
+
+static void compilePatterns(PatternList* list, char** patterns, int patterns_num);
+static int hasWildcards(const char* s, int len);
+static int matchPattern(const Pattern* pattern, const char* path, const char* base_name, int path_len, int base_name_len);
+static int matchList(const PatternList* list, const char* path);
+static void addRoot(const char* root);
+static const char* getRelativePath(const char* path);
+
+void FILTER_Init(Settings* _settings)
+{
+	int i, num = ARG_GetPathsNum();
+	settings = _settings;
+	if(num == 0) {
+		addRoot(".");
+	}
+	for(i = 0; i < num; ++i) {
+		addRoot(ARG_GetPath(i));
+	}
+	compilePatterns(&include_list, settings->include_patterns, settings->include_patterns_num);
+	compilePatterns(&exclude_list, settings->exclude_patterns, settings->exclude_patterns_num);
+	is_output_dir_set = (settings->output_dir != NULL) && (stat(settings->output_dir, &output_dir) == 0);
+	is_chunks_dir_set = (settings->chunks_dir != NULL) && (stat(settings->chunks_dir, &chunks_dir) == 0);
+}
+
+void FILTER_Quit()
+{
+	free(include_list.patterns);
+	free(exclude_list.patterns);
+	include_list.patterns = NULL;
+	include_list.patterns_num = 0;
+	exclude_list.patterns = NULL;
+	exclude_list.patterns_num = 0;
+	free(roots);
+	free(root_lens);
+	roots = NULL;
+	root_lens = NULL;
+	roots_num = 0;
+}
+
+/* The output directory and the chunk store are never walked, even if
+   they are inside the tree. */
+int FILTER_IsDirExcluded(const char* path, const struct stat* s)
+{
+	if(is_output_dir_set && (s->st_dev == output_dir.st_dev) && (s->st_ino == output_dir.st_ino)) {
+		return 1;
+	}
+	if(is_chunks_dir_set && (s->st_dev == chunks_dir.st_dev) && (s->st_ino == chunks_dir.st_ino)) {
+		return 1;
+	}
+	return matchList(&exclude_list, path);
+}
+
+int FILTER_IsFileAccepted(const char* path, const struct stat* s)
+{
+	if((settings->min_size >= 0) && (s->st_size < settings->min_size)) {
+		return 0;
+	}
+	if((settings->max_size >= 0) && (s->st_size > settings->max_size)) {
+		return 0;
+	}
+	if((settings->min_mtime >= 0) && (s->st_mtime < settings->min_mtime)) {
+		return 0;
+	}
+	if((settings->max_mtime >= 0) && (s->st_mtime > settings->max_mtime)) {
+		return 0;
+	}
+	if(matchList(&exclude_list, path)) {
+		return 0;
+	}
+	if((include_list.patterns_num > 0) && !matchList(&include_list, path)) {
+		return 0;
+	}
+	return 1;
+}
+
+static void compilePatterns(PatternList* list, char** patterns, int patterns_num)
+{
+	int i, len;
+	const char* s = NULL;
+	Pattern* pattern = NULL;
+	list->patterns = (Pattern*)malloc(sizeof(Pattern) * (patterns_num + 1));
+	list->patterns_num = patterns_num;
+	for(i = 0; i < patterns_num; ++i) {
+		s = patterns[i];
+		while(strncmp(s, "./", 2) == 0) {
+			s += 2;
+		}
+		len = strlen(s);
+		pattern = &list->patterns[i];
+		pattern->is_full_path = (strchr(s, '/') != NULL);
+		if(!hasWildcards(s, len)) {
+			pattern->type = PATTERN_LITERAL;
+			pattern->text = s;
+			pattern->len = len;
+		} else if(!pattern->is_full_path && (s[0] == '*') && !hasWildcards(s + 1, len - 1)) {
+			pattern->type = PATTERN_SUFFIX;
+			pattern->text = s + 1;
+			pattern->len = len - 1;
+		} else if(!pattern->is_full_path && (s[len - 1] == '*') && !hasWildcards(s, len - 1)) {
+			pattern->type = PATTERN_PREFIX;
+			pattern->text = s;
+			pattern->len = len - 1;
+		} else {
+			pattern->type = PATTERN_GLOB;
+			pattern->text = s;
+			pattern->len = len;
+		}
+	}
+}
+
+static int hasWildcards(const char* s, int len)
+{
+	int i;
+	for(i = 0; i < len; ++i) {
+		if((s[i] == '*') || (s[i] == '?') || (s[i] == '[') || (s[i] == '\\')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Patterns without a slash are matched against the base name, other
+   ones against the path relative to the walked directory. */
+static int matchPattern(const Pattern* pattern, const char* path, const char* base_name, int path_len, int base_name_len)
+{
+	const char* s = pattern->is_full_path ? path : base_name;
+	int len = pattern->is_full_path ? path_len : base_name_len;
+	switch(pattern->type) {
+	case PATTERN_LITERAL:
+		return (len == pattern->len) && (memcmp(s, pattern->text, len) == 0);
+	case PATTERN_PREFIX:
+		return (len >= pattern->len) && (memcmp(s, pattern->text, pattern->len) == 0);
+	case PATTERN_SUFFIX:
+		return (len >= pattern->len) && (memcmp(s + len - pattern->len, pattern->text, pattern->len) == 0);
+	default:
+		return fnmatch(pattern->text, s, pattern->is_full_path ? FNM_PATHNAME : 0) == 0;
+	}
+}
+
+static int matchList(const PatternList* list, const char* path)
+{
+	int i;
+	int path_len = 0;
+	const char* base_name = NULL;
+	if(list->patterns_num == 0) {
+		return 0;
+	}
+	path = getRelativePath(path);
+	path_len = strlen(path);
+	base_name = strrchr(path, '/');
+	base_name = (base_name != NULL) ? base_name + 1 : path;
+	for(i = 0; i < list->patterns_num; ++i) {
+		if(matchPattern(&list->patterns[i], path, base_name, path_len, path_len - (base_name - path))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void addRoot(const char* root)
+{
+	int len = strlen(root);
+	while((len > 0) && (root[len - 1] == '/')) {
+		--len;
+	}
+	roots = (const char**)realloc(roots, sizeof(char*) * (roots_num + 1));
+	root_lens = (int*)realloc(root_lens, sizeof(int) * (roots_num + 1));
+	roots[roots_num] = root;
+	root_lens[roots_num] = len;
+	++roots_num;
+}
+
+/* Paths found by walking a directory from the command line start with
+   that directory, which is cut off. Other paths, like the ones from
+   --files-from, are taken relative to the working directory. */
+static const char* getRelativePath(const char* path)
+{
+	const char* result = NULL;
+	int i;
+	for(i = 0; i < roots_num; ++i) {
+		if((strncmp(path, roots[i], root_lens[i]) == 0) && (path[root_lens[i]] == '/')
+		   && ((result == NULL) || (path + root_lens[i] < result))) {
+			result = path + root_lens[i];
+		}
+	}
+	if(result != NULL) {
+		while(*result == '/') {
+			++result;
+		}
+		return result;
+	}
+	while(strncmp(path, "./", 2) == 0) {
+		path += 2;
+	}
+	return path;
+}
@@ -0,0 +1,77 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+
+/* Layout of encrypted files. Data is stored in blocks of BLOCK_SIZE
+   bytes, each encrypted separately, after the header. */
+
+#define BLOCK_SIZE 1024
+#define KEY_SIZE 32
+#define KEY_HASH_SIZE 32
+#define NONCE_SIZE 16
+#define MAX_TAG_SIZE 16
+
+/* Files in the envelope format start with this magic. Old files start
+   with the size of the last block, which never exceeds BLOCK_SIZE, so
+   the third byte of the magic can't appear there. */
+#define HEADER_MAGIC "DCE3"
+#define HEADER_MAGIC_V2 "DCE2"
+#define HEADER_MAGIC_SIZE 4
+
+/* Magic, size of the last block, encrypted key hash, wrapped data key,
+   cipher id and nonce. With an AEAD cipher every data block is followed
+   by its tag, the tags cover the magic, cipher id and nonce, and the
+   last block is marked, so a file always has at least one block. */
+#define HEADER_SIZE (HEADER_SIZE_V2 + sizeof(uint32_t) + NONCE_SIZE)
+/* Magic, size of the last block, encrypted key hash and wrapped data
+   key. Data is encrypted with AES-256 in ECB mode. */
+#define HEADER_SIZE_V2 (HEADER_MAGIC_SIZE + sizeof(uint32_t) + KEY_HASH_SIZE + KEY_SIZE)
+/* Size of the last block and encrypted key hash. */
+#define LEGACY_HEADER_SIZE (sizeof(uint32_t) + KEY_HASH_SIZE)
+
+/* Files put into a chunk store are replaced by a recipe: magic,
+   encrypted key hash, wrapped data key, nonce, file size and number of
+   chunks, followed by an entry for every chunk and a trailer. */
+#define RECIPE_MAGIC "DCK1"
+#define RECIPE_HEADER_SIZE (HEADER_MAGIC_SIZE + KEY_HASH_SIZE + KEY_SIZE + NONCE_SIZE + 2 * sizeof(uint64_t))
+/* Chunk key and size. Entries are encrypted with AES-256-GCM like data
+   blocks of the file format, each followed by its tag. */
+#define RECIPE_ENTRY_SIZE (KEY_SIZE + sizeof(uint32_t))
+/* File size and number of chunks again, encrypted as the last block,
+   so that the header and the number of entries are authenticated. */
+#define RECIPE_TRAILER_SIZE (2 * sizeof(uint64_t))
+#define RECIPE_TAG_SIZE 16
+
+/* The chunk store keeps its own secret, from which the chunk keys are
+   computed, in DIR/key: magic, the secret encrypted with the user key
+   and a hash of the secret to check the key. So chunks stay the same
+   when the user key changes and only this file is rewrapped. */
+#define STORE_KEY_MAGIC "DCS1"
+#define STORE_KEY_FILE_SIZE (HEADER_MAGIC_SIZE + 2 * KEY_SIZE)
+
+/* Chunk boundaries depend only on the data, so changing these breaks
+   deduplication against existing chunk stores. */
+#define MIN_CHUNK_SIZE (16 * 1024)
+#define MAX_CHUNK_SIZE (256 * 1024)
+/* Stored chunks are followed by their tag. */
+#define CHUNK_TAG_SIZE 16
+
+#endif
@@ -20,16 +20,29 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "arg.h"
+#include "chunk.h"
 #include "crypt.h"
 #include "fedi.h"
+#include "filter.h"
+#include "progress.h"
+#include "sched.h"
 #include "tty.h"
+#include "visit.h"
 #include "settings.h"
+#include "topo.h"
+#include "trace.h"
+#include "watch.h"
 
 static Settings settings;
+static sigset_t termination_signals;
+static volatile int is_terminated = 0;
 
-static void terminationHandler(int signum);
+static void* signalMain(void* data);
 
 void readAction()
 {
@@ -69,43 +82,67 @@ void readAction()
 
 void readKey()
 {
-	int len = 1;
-	struct termios s;
-	TTY_Capture(&s);
-	s.c_lflag &= ~ECHO;
-	TTY_SetState(&s);
-	while(len == 1) {
-		printf("\rKey: ");
-		fflush(stdout);
-		len = read(tty, settings.key, MAX_KEY_LENGTH);
-	}
-	settings.key_len = len - 1;
-	TTY_Release();
-	printf("\n");
+	settings.key_len = TTY_ReadKey(settings.key, MAX_KEY_LENGTH);
 }
 
-static void terminationHandler(int signum)
+/* Termination signals are blocked in every thread and taken here, so
+   stopping can lock and wake the others. Workers give up their files and
+   main finishes as after an error. While the terminal is captured
+   nothing has started yet and the program just exits. */
+static void* signalMain(void* data)
 {
-	FEDI_Quit();
-	if(TTY_IsCaptured()) {
-		TTY_Release();
+	int signum;
+	while(sigwait(&termination_signals, &signum) == 0) {
+		if(TTY_IsCaptured()) {
+			TTY_Release();
+			printf("\n");
+			exit(-1);
+		}
+		is_terminated = 1;
+		SCHED_Stop();
+		FEDI_Stop();
+		WATCH_Stop();
 	}
-	printf("\n");
-	exit(0);
+	return NULL;
 }
 
 int main(int argc, char **argv)
 {
-	int i, num;
+	int i, num, result;
 	char* path;
-	signal(SIGINT, terminationHandler);
-	signal(SIGHUP, terminationHandler);
-	signal(SIGTERM, terminationHandler);
-	signal(SIGQUIT, terminationHandler);
+	pthread_t signal_thread;
+	sigemptyset(&termination_signals);
+	sigaddset(&termination_signals, SIGINT);
+	sigaddset(&termination_signals, SIGHUP);
+	sigaddset(&termination_signals, SIGTERM);
+	sigaddset(&termination_signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &termination_signals, NULL);
+	if(pthread_create(&signal_thread, NULL, signalMain, NULL) != 0) {
+		fprintf(stderr, "Failed to start signal thread\n");
+		exit(-1);
+	}
 	FEDI_Init(argv[0], &settings);
 	SETTINGS_Init(&settings);
 	CRYPT_Init();
 	ARG_Parse(argc, argv, &settings);
+	if((settings.chunks_dir != NULL) && settings.is_cipher_set) {
+		fprintf(stderr, "--cipher can't be used with --chunks, chunks and recipes always use AES-256-GCM\n");
+		exit(-1);
+	}
+	if(settings.is_watch && settings.is_rekey) {
+		fprintf(stderr, "--watch can't be used with --rekey, changed files are not encrypted with the old key\n");
+		exit(-1);
+	}
+	if(settings.output_dir != NULL) {
+		if(settings.is_rekey) {
+			fprintf(stderr, "Key can only be changed in place, without --output-dir\n");
+			exit(-1);
+		}
+		if((mkdir(settings.output_dir, 0777) != 0) && (errno != EEXIST)) {
+			fprintf(stderr, "Failed to create %s\n", settings.output_dir);
+			exit(-1);
+		}
+	}
 	if(!settings.is_action_set) {
 		readAction();
 	}
@@ -113,22 +150,73 @@ int main(int argc, char **argv)
 		readKey();
 	}
 	CRYPT_ReadSettings(&settings);
-	if(settings.is_encrypt) {
+	if(settings.is_rekey) {
+		puts("Starting key change...");
+	} else if(settings.is_encrypt) {
 		puts("Starting encryption...");
 	} else {
 		puts("Starting decryption...");
 	}
+	CHUNK_Init(&settings);
+	FILTER_Init(&settings);
+	VISIT_Init(&settings);
+	TOPO_Init(&settings);
+	if(settings.trace_file != NULL) {
+		TRACE_Init(settings.trace_file);
+	}
+	SCHED_Init(&settings);
+	PROGRESS_Init(&settings);
 	num = ARG_GetPathsNum();
-	if(num == 0) {
-		FEDI_ProcessPath(".");
+	/* Watches go first, so that files written during the initial pass
+	   are not missed. */
+	if(settings.is_watch) {
+		WATCH_Init(&settings);
+		if((num == 0) && (settings.files_from == NULL)) {
+			WATCH_AddPath(".");
+		} else {
+			for(i = 0; i < num; ++i) {
+				WATCH_AddPath(ARG_GetPath(i));
+			}
+		}
+	}
+	if((num == 0) && (settings.files_from == NULL)) {
+		SCHED_AddPath(".");
 	} else {
 		for(i = 0; i < num; ++i) {
 			path = ARG_GetPath(i);
-			FEDI_ProcessPath(path);
+			SCHED_AddPath(path);
 		}
 	}
+	result = 0;
+	if(settings.files_from != NULL) {
+		result = SCHED_AddFileList(settings.files_from, settings.is_null_delimited ? '\0' : '\n');
+	}
+	if(SCHED_Run() != 0) {
+		result = -1;
+	}
+	PROGRESS_Quit();
+	if(settings.is_watch) {
+		if((result == 0) || settings.is_ignore_errors) {
+			if(settings.is_verbose) {
+				puts("Watching for changes...");
+			}
+			result = WATCH_Run();
+		}
+		WATCH_Quit();
+	}
+	if(is_terminated) {
+		fprintf(stderr, "Interrupted, unfinished files were left as they were\n");
+		result = -1;
+	}
+	SCHED_Quit();
+	TRACE_Quit();
+	TOPO_Quit();
+	VISIT_Quit();
+	FILTER_Quit();
+	CHUNK_Quit();
 	ARG_Quit();
+	SETTINGS_Quit(&settings);
 	CRYPT_Quit();
 	FEDI_Quit();
-	return 0;
+	return result;
 }
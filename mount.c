@@ -0,0 +1,602 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "crypt.h"
+#include "format.h"
+#include "settings.h"
+#include "tty.h"
+
+/* Decrypted data is cached in pages of PAGE_BLOCKS blocks. */
+#define PAGE_BLOCKS 32
+#define PAGE_SIZE (PAGE_BLOCKS * BLOCK_SIZE)
+#define MAX_READAHEAD_PAGES 32
+#define DEFAULT_CACHE_SIZE 64
+
+/* Pages are keyed by the size and modification time of the encrypted
+   file too, so that a rewritten file or a reused inode never gets the
+   old data. */
+typedef struct PageKey
+{
+	dev_t device;
+	ino_t inode;
+	off_t raw_size;
+	struct timespec mtime;
+} PageKey;
+
+typedef struct OpenFile
+{
+	int fd;
+	PageKey key;
+	char is_encrypted;
+	char is_legacy_format;
+	uint32_t cipher;
+	int tag_size;
+	int last_block_size;
+	uint8_t data_key[KEY_SIZE];
+	uint8_t nonce[NONCE_SIZE];
+	off_t header_size;
+	off_t data_size;
+	off_t size;
+	pthread_mutex_t lock;
+	off_t next_offset;
+	int readahead_pages;
+} OpenFile;
+
+typedef struct Page
+{
+	PageKey key;
+	int64_t index;
+	int size;
+	uint8_t data[PAGE_SIZE];
+	struct Page* hash_next;
+	struct Page* prev;
+	struct Page* next;
+} Page;
+
+static Settings settings;
+static int source_fd = -1;
+static pthread_key_t crypt_key;
+
+/* LRU list of cached pages, most recently used first. */
+static Page** page_table = NULL;
+static int page_table_size = 0;
+static Page lru_list;
+static int pages_num = 0;
+static int max_pages = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void printUsage(const char* prog_name);
+static void initCrypt();
+static void quitCrypt(void* data);
+static const char* getSourcePath(const char* path);
+static int readHeader(int fd, off_t raw_size, OpenFile* file);
+static int readFull(int fd, uint8_t* data, size_t size, off_t offset);
+
+static void initCache(int size_mb);
+static Page** findPage(const PageKey* key, int64_t index);
+static int isPageCached(OpenFile* file, int64_t index);
+static void unlinkPage(Page* page);
+static void pushPage(Page* page);
+static int readCachedPage(OpenFile* file, int64_t index, int offset, char* out, int len);
+static void insertPage(OpenFile* file, int64_t index, const uint8_t* data, int size);
+static int loadPages(OpenFile* file, int64_t index, int count, int offset, char* out, int len);
+
+static int mountGetattr(const char* path, struct stat* s, struct fuse_file_info* fi);
+static int mountReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags);
+static int mountOpen(const char* path, struct fuse_file_info* fi);
+static int mountRead(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
+static int mountRelease(const char* path, struct fuse_file_info* fi);
+static int mountStatfs(const char* path, struct statvfs* s);
+
+static const struct fuse_operations operations = {
+	.getattr = mountGetattr,
+	.readdir = mountReaddir,
+	.open = mountOpen,
+	.read = mountRead,
+	.release = mountRelease,
+	.statfs = mountStatfs
+};
+
+static void printUsage(const char* prog_name)
+{
+	printf("Usage: %s [-k KEY] [-c CACHE_MB] SOURCE MOUNTPOINT [FUSE OPTION]...\n"
+	       "Show decrypted contents of SOURCE at MOUNTPOINT (read-only).\n", prog_name);
+}
+
+int main(int argc, char** argv)
+{
+	int i = 1;
+	int cache_size = DEFAULT_CACHE_SIZE;
+	char** fuse_argv = NULL;
+	int fuse_argc = 0;
+	int result;
+
+	SETTINGS_Init(&settings);
+	while((i < argc) && (argv[i][0] == '-')) {
+		if((strcmp(argv[i], "-k") == 0) && (i + 1 < argc)) {
+			strncpy((char*)settings.key, argv[i + 1], MAX_KEY_LENGTH);
+			settings.key_len = strlen((char*)settings.key);
+			settings.is_key_set = 1;
+			i += 2;
+		} else if((strcmp(argv[i], "-c") == 0) && (i + 1 < argc)) {
+			cache_size = atoi(argv[i + 1]);
+			i += 2;
+		} else {
+			printUsage(argv[0]);
+			return (strcmp(argv[i], "-h") == 0) ? 0 : -1;
+		}
+	}
+	if((argc - i < 2) || (cache_size < 0)) {
+		printUsage(argv[0]);
+		return -1;
+	}
+
+	source_fd = open(argv[i], O_RDONLY | O_DIRECTORY);
+	if(source_fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", argv[i]);
+		return -1;
+	}
+	if(!settings.is_key_set) {
+		settings.key_len = TTY_ReadKey(settings.key, MAX_KEY_LENGTH);
+	}
+	CRYPT_Init();
+	CRYPT_ReadSettings(&settings);
+	pthread_key_create(&crypt_key, quitCrypt);
+	initCache(cache_size);
+
+	fuse_argv = (char**)malloc(sizeof(char*) * (argc + 3));
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = argv[i + 1];
+	fuse_argv[fuse_argc++] = "-o";
+	/* auto_cache drops the kernel cache of files changed since they
+	   were last opened. */
+	fuse_argv[fuse_argc++] = "ro,auto_cache";
+	for(i += 2; i < argc; ++i) {
+		fuse_argv[fuse_argc++] = argv[i];
+	}
+	result = fuse_main(fuse_argc, fuse_argv, &operations, NULL);
+
+	free(fuse_argv);
+	CRYPT_Quit();
+	close(source_fd);
+	return result;
+}
+
+/* Cipher handles are per thread, FUSE threads get theirs on first use. */
+static void initCrypt()
+{
+	if(pthread_getspecific(crypt_key) == NULL) {
+		CRYPT_InitThread();
+		pthread_setspecific(crypt_key, &crypt_key);
+	}
+}
+
+static void quitCrypt(void* data)
+{
+	CRYPT_QuitThread();
+}
+
+static const char* getSourcePath(const char* path)
+{
+	while(*path == '/') {
+		++path;
+	}
+	return (*path != '\0') ? path : ".";
+}
+
+/* Files which are not encrypted with the given key are shown as is. */
+static int readHeader(int fd, off_t raw_size, OpenFile* file)
+{
+	uint8_t header[HEADER_SIZE];
+	uint8_t* p = header;
+	uint32_t last_block_size;
+	off_t blocks_num;
+
+	file->is_encrypted = 0;
+	file->size = raw_size;
+	if((raw_size < LEGACY_HEADER_SIZE) || (readFull(fd, header, LEGACY_HEADER_SIZE, 0) != 0)) {
+		return 0;
+	}
+	if(memcmp(header, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		file->header_size = HEADER_SIZE;
+	} else if(memcmp(header, HEADER_MAGIC_V2, HEADER_MAGIC_SIZE) == 0) {
+		file->header_size = HEADER_SIZE_V2;
+	} else {
+		file->header_size = LEGACY_HEADER_SIZE;
+	}
+	file->is_legacy_format = (file->header_size == LEGACY_HEADER_SIZE);
+	if(!file->is_legacy_format) {
+		if((raw_size < file->header_size) || (readFull(fd, header, file->header_size, 0) != 0)) {
+			return 0;
+		}
+		p += HEADER_MAGIC_SIZE;
+	}
+	memcpy(&last_block_size, p, sizeof(uint32_t));
+	p += sizeof(uint32_t);
+	file->cipher = CRYPT_CIPHER_AES256_ECB;
+	if(file->header_size == HEADER_SIZE) {
+		memcpy(&file->cipher, p + KEY_HASH_SIZE + KEY_SIZE, sizeof(uint32_t));
+		memcpy(file->nonce, p + KEY_HASH_SIZE + KEY_SIZE + sizeof(uint32_t), NONCE_SIZE);
+		if(file->cipher >= CRYPT_CIPHERS_NUM) {
+			return 0;
+		}
+	}
+	file->tag_size = CRYPT_GetTagSize(file->cipher);
+	file->data_size = raw_size - file->header_size;
+	if((last_block_size > BLOCK_SIZE) || (file->data_size % (BLOCK_SIZE + file->tag_size) != 0)) {
+		return 0;
+	}
+
+	initCrypt();
+	CRYPT_Decrypt(p, KEY_HASH_SIZE);
+	if(memcmp(p, CRYPT_GetKeyHash(), KEY_HASH_SIZE) != 0) {
+		return 0;
+	}
+	p += KEY_HASH_SIZE;
+	if(!file->is_legacy_format) {
+		memcpy(file->data_key, p, KEY_SIZE);
+		CRYPT_Decrypt(file->data_key, KEY_SIZE);
+	}
+
+	blocks_num = file->data_size / (BLOCK_SIZE + file->tag_size);
+	if((blocks_num == 0) && (file->tag_size > 0)) {
+		return 0;
+	}
+	file->last_block_size = last_block_size;
+	file->size = (blocks_num > 0) ? (blocks_num - 1) * BLOCK_SIZE + last_block_size : 0;
+	file->is_encrypted = 1;
+	return 0;
+}
+
+static int readFull(int fd, uint8_t* data, size_t size, off_t offset)
+{
+	ssize_t len;
+	while(size > 0) {
+		len = pread(fd, data, size, offset);
+		if(len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		} else if(len == 0) {
+			return -EIO;
+		}
+		data += len;
+		size -= len;
+		offset += len;
+	}
+	return 0;
+}
+
+static void initCache(int size_mb)
+{
+	max_pages = (int64_t)size_mb * 1024 * 1024 / PAGE_SIZE;
+	page_table_size = 1;
+	while(page_table_size < max_pages) {
+		page_table_size *= 2;
+	}
+	page_table = (Page**)calloc(page_table_size, sizeof(Page*));
+	lru_list.prev = &lru_list;
+	lru_list.next = &lru_list;
+}
+
+static Page** findPage(const PageKey* key, int64_t index)
+{
+	uint64_t hash = ((uint64_t)key->inode * 31 + (uint64_t)key->device) * 2654435761u + (uint64_t)index;
+	Page** it = &page_table[hash & (page_table_size - 1)];
+	while((*it != NULL)
+	      && !(((*it)->key.inode == key->inode) && ((*it)->key.device == key->device)
+	           && ((*it)->key.raw_size == key->raw_size)
+	           && ((*it)->key.mtime.tv_sec == key->mtime.tv_sec)
+	           && ((*it)->key.mtime.tv_nsec == key->mtime.tv_nsec)
+	           && ((*it)->index == index))) {
+		it = &(*it)->hash_next;
+	}
+	return it;
+}
+
+static int isPageCached(OpenFile* file, int64_t index)
+{
+	int result;
+	if(max_pages == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&cache_lock);
+	result = (*findPage(&file->key, index) != NULL);
+	pthread_mutex_unlock(&cache_lock);
+	return result;
+}
+
+static void unlinkPage(Page* page)
+{
+	page->prev->next = page->next;
+	page->next->prev = page->prev;
+}
+
+static void pushPage(Page* page)
+{
+	page->next = lru_list.next;
+	page->prev = &lru_list;
+	lru_list.next->prev = page;
+	lru_list.next = page;
+}
+
+/* Returns 1 and copies the data if the page is cached. */
+static int readCachedPage(OpenFile* file, int64_t index, int offset, char* out, int len)
+{
+	Page* page = NULL;
+	if(max_pages == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&cache_lock);
+	page = *findPage(&file->key, index);
+	if(page != NULL) {
+		unlinkPage(page);
+		pushPage(page);
+		memcpy(out, page->data + offset, len);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return page != NULL;
+}
+
+static void insertPage(OpenFile* file, int64_t index, const uint8_t* data, int size)
+{
+	Page** it = NULL;
+	Page* page = NULL;
+	if(max_pages == 0) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	it = findPage(&file->key, index);
+	if(*it != NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	if(pages_num < max_pages) {
+		page = (Page*)malloc(sizeof(Page));
+		++pages_num;
+	} else {
+		page = lru_list.prev;
+		unlinkPage(page);
+		*findPage(&page->key, page->index) = page->hash_next;
+		it = findPage(&file->key, index);
+	}
+	page->key = file->key;
+	page->index = index;
+	page->size = size;
+	memcpy(page->data, data, size);
+	page->hash_next = NULL;
+	*it = page;
+	pushPage(page);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Reads and decrypts count pages at once, copying the requested part
+   of the first one and caching the rest for the following reads. Tags
+   of the blocks are dropped, so pages hold only the file data. */
+static int loadPages(OpenFile* file, int64_t index, int count, int offset, char* out, int len)
+{
+	int disk_block_size = BLOCK_SIZE + file->tag_size;
+	int64_t first_block = index * PAGE_BLOCKS;
+	int64_t blocks = (int64_t)count * PAGE_BLOCKS;
+	int64_t blocks_num = file->data_size / disk_block_size;
+	off_t start = index * PAGE_SIZE;
+	uint8_t* data = NULL;
+	uint8_t* block = NULL;
+	off_t page_size;
+	int64_t i;
+	int result;
+
+	if(first_block + blocks > blocks_num) {
+		blocks = blocks_num - first_block;
+		count = (blocks + PAGE_BLOCKS - 1) / PAGE_BLOCKS;
+	}
+	data = (uint8_t*)malloc(blocks * disk_block_size);
+	result = readFull(file->fd, data, blocks * disk_block_size, file->header_size + first_block * disk_block_size);
+	if(result != 0) {
+		free(data);
+		return result;
+	}
+
+	initCrypt();
+	if(file->is_legacy_format) {
+		CRYPT_Decrypt(data, blocks * BLOCK_SIZE);
+	} else {
+		CRYPT_SetDataCipher(file->cipher);
+		CRYPT_SetDataKey(file->data_key, KEY_SIZE);
+		for(i = 0; i < blocks; ++i) {
+			block = data + i * disk_block_size;
+			if(CRYPT_DecryptData(block, BLOCK_SIZE, file->nonce, first_block + i,
+			                     (first_block + i == blocks_num - 1) ? file->last_block_size : -1,
+			                     block + BLOCK_SIZE) != 0) {
+				free(data);
+				return -EIO;
+			}
+			memmove(data + i * BLOCK_SIZE, block, BLOCK_SIZE);
+		}
+	}
+	memcpy(out, data + offset, len);
+	for(i = 0; i < count; ++i) {
+		page_size = file->size - start - (off_t)i * PAGE_SIZE;
+		if(page_size > PAGE_SIZE) {
+			page_size = PAGE_SIZE;
+		}
+		insertPage(file, index + i, data + (off_t)i * PAGE_SIZE, page_size);
+	}
+	free(data);
+	return 0;
+}
+
+static int mountGetattr(const char* path, struct stat* s, struct fuse_file_info* fi)
+{
+	OpenFile file;
+	int fd;
+	if(fstatat(source_fd, getSourcePath(path), s, 0) != 0) {
+		return -errno;
+	}
+	if(S_ISREG(s->st_mode)) {
+		fd = openat(source_fd, getSourcePath(path), O_RDONLY);
+		if(fd >= 0) {
+			readHeader(fd, s->st_size, &file);
+			s->st_size = file.size;
+			close(fd);
+		}
+	}
+	s->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	return 0;
+}
+
+static int mountReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags)
+{
+	DIR* dir = NULL;
+	struct dirent* entry = NULL;
+	int fd = openat(source_fd, getSourcePath(path), O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		return -errno;
+	}
+	dir = fdopendir(fd);
+	if(dir == NULL) {
+		close(fd);
+		return -errno;
+	}
+	while((entry = readdir(dir)) != NULL) {
+		if(filler(buf, entry->d_name, NULL, 0, 0) != 0) {
+			break;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int mountOpen(const char* path, struct fuse_file_info* fi)
+{
+	OpenFile* file = NULL;
+	struct stat s;
+	int fd;
+	if((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EROFS;
+	}
+	fd = openat(source_fd, getSourcePath(path), O_RDONLY);
+	if(fd < 0) {
+		return -errno;
+	}
+	if(fstat(fd, &s) != 0) {
+		close(fd);
+		return -errno;
+	}
+	file = (OpenFile*)malloc(sizeof(OpenFile));
+	file->fd = fd;
+	file->key.device = s.st_dev;
+	file->key.inode = s.st_ino;
+	file->key.raw_size = s.st_size;
+	file->key.mtime = s.st_mtim;
+	pthread_mutex_init(&file->lock, NULL);
+	file->next_offset = 0;
+	file->readahead_pages = 0;
+	readHeader(fd, s.st_size, file);
+	fi->fh = (uint64_t)(uintptr_t)file;
+	return 0;
+}
+
+static int mountRead(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	OpenFile* file = (OpenFile*)(uintptr_t)fi->fh;
+	size_t done = 0;
+	int64_t index, pages_num;
+	int page_offset, len, count, readahead_pages, result;
+	ssize_t read_len;
+
+	if(!file->is_encrypted) {
+		read_len = pread(file->fd, buf, size, offset);
+		return (read_len < 0) ? -errno : read_len;
+	}
+	if(offset >= file->size) {
+		return 0;
+	}
+	if(offset + size > file->size) {
+		size = file->size - offset;
+	}
+
+	/* Sequential reads grow the readahead window, others reset it. */
+	pthread_mutex_lock(&file->lock);
+	if(offset == file->next_offset) {
+		file->readahead_pages = file->readahead_pages ? file->readahead_pages * 2 : 1;
+		if(file->readahead_pages > MAX_READAHEAD_PAGES) {
+			file->readahead_pages = MAX_READAHEAD_PAGES;
+		}
+	} else {
+		file->readahead_pages = 0;
+	}
+	file->next_offset = offset + size;
+	readahead_pages = file->readahead_pages;
+	pthread_mutex_unlock(&file->lock);
+	pages_num = (file->size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	while(done < size) {
+		index = (offset + done) / PAGE_SIZE;
+		page_offset = (offset + done) % PAGE_SIZE;
+		len = PAGE_SIZE - page_offset;
+		if(len > size - done) {
+			len = size - done;
+		}
+		if(!readCachedPage(file, index, page_offset, buf + done, len)) {
+			/* Readahead stops at the first page which is already cached. */
+			for(count = 1; (count <= readahead_pages) && (index + count < pages_num)
+			               && !isPageCached(file, index + count); ++count) {
+			}
+			result = loadPages(file, index, count, page_offset, buf + done, len);
+			if(result != 0) {
+				return result;
+			}
+		}
+		done += len;
+	}
+	return size;
+}
+
+static int mountRelease(const char* path, struct fuse_file_info* fi)
+{
+	OpenFile* file = (OpenFile*)(uintptr_t)fi->fh;
+	close(file->fd);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+	return 0;
+}
+
+static int mountStatfs(const char* path, struct statvfs* s)
+{
+	if(fstatvfs(source_fd, s) != 0) {
+		return -errno;
+	}
+	return 0;
+}
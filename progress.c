@@ -0,0 +1,310 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "arg.h"
+#include "filter.h"
+#include "progress.h"
+#include "settings.h"
+
+/* Workers add their bytes to the shared counter in steps of this size. */
+#define FLUSH_SIZE (1024 * 1024)
+#define UPDATE_INTERVAL 1000
+#define DEFAULT_LINE_WIDTH 80
+
+/* Totals are summed by a pre-scan thread walking the same paths as the
+   scheduler. Until it is done, or when names come from stdin, progress
+   is shown without percentage and ETA. */
+static Settings* settings = NULL;
+static char is_enabled = 0;
+static volatile int is_stopped = 0;
+static volatile int is_scan_done = 0;
+static char is_total_known = 0;
+static int64_t total_files = 0;
+static int64_t total_bytes = 0;
+static int64_t done_files = 0;
+static int64_t done_bytes = 0;
+static char current_file[PATH_MAX];
+static pthread_t scan_thread;
+static pthread_t display_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static __thread int64_t file_bytes = 0;
+static __thread int64_t pending_bytes = 0;
+
+static void* scanMain(void* data);
+static int scanCallback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf);
+static void scanFileList(const char* list_name, char delimiter);
+static void addTotal(int64_t size);
+static void* displayMain(void* data);
+static void formatStatus(char* line, int size, double rate, char is_final);
+static void formatSize(char* buffer, int size, double bytes);
+static int getLineWidth();
+static int64_t getTime();
+
+void PROGRESS_Init(Settings* _settings)
+{
+	settings = _settings;
+	if(!settings->is_progress) {
+		return;
+	}
+	is_enabled = 1;
+	is_total_known = (settings->files_from == NULL) || (strcmp(settings->files_from, "-") != 0);
+	current_file[0] = '\0';
+	if((pthread_create(&scan_thread, NULL, scanMain, NULL) != 0)
+	   || (pthread_create(&display_thread, NULL, displayMain, NULL) != 0)) {
+		fprintf(stderr, "Failed to start progress thread\n");
+		exit(-1);
+	}
+}
+
+void PROGRESS_Quit()
+{
+	if(!is_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	is_stopped = 1;
+	pthread_cond_signal(&stop_cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(display_thread, NULL);
+	pthread_join(scan_thread, NULL);
+	is_enabled = 0;
+}
+
+void PROGRESS_StartFile(const char* file_name)
+{
+	if(!is_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	strncpy(current_file, file_name, PATH_MAX - 1);
+	current_file[PATH_MAX - 1] = '\0';
+	pthread_mutex_unlock(&lock);
+}
+
+/* Called for every block, so it only touches the shared counter once
+   in a while. */
+void PROGRESS_AddBytes(int64_t bytes)
+{
+	if(!is_enabled) {
+		return;
+	}
+	pending_bytes += bytes;
+	if(pending_bytes >= FLUSH_SIZE) {
+		__atomic_add_fetch(&done_bytes, pending_bytes, __ATOMIC_RELAXED);
+		file_bytes += pending_bytes;
+		pending_bytes = 0;
+	}
+}
+
+/* The whole file counts as done, whatever part of it was read. */
+void PROGRESS_EndFile(int64_t size)
+{
+	if(!is_enabled) {
+		return;
+	}
+	__atomic_add_fetch(&done_bytes, size - file_bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&done_files, 1, __ATOMIC_RELAXED);
+	file_bytes = 0;
+	pending_bytes = 0;
+}
+
+static void* scanMain(void* data)
+{
+	int i, num = ARG_GetPathsNum();
+	if((num == 0) && (settings->files_from == NULL)) {
+		nftw(".", scanCallback, 16, FTW_ACTIONRETVAL);
+	} else {
+		for(i = 0; (i < num) && !is_stopped; ++i) {
+			nftw(ARG_GetPath(i), scanCallback, 16, FTW_ACTIONRETVAL);
+		}
+	}
+	if((settings->files_from != NULL) && (strcmp(settings->files_from, "-") != 0)) {
+		scanFileList(settings->files_from, settings->is_null_delimited ? '\0' : '\n');
+	}
+	is_scan_done = 1;
+	return NULL;
+}
+
+static int scanCallback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf)
+{
+	if(is_stopped) {
+		return FTW_STOP;
+	}
+	if(type == FTW_D) {
+		if(FILTER_IsDirExcluded(file_name, s)) {
+			return FTW_SKIP_SUBTREE;
+		}
+	} else if((type == FTW_F) && FILTER_IsFileAccepted(file_name, s)) {
+		addTotal(s->st_size);
+	}
+	return FTW_CONTINUE;
+}
+
+static void scanFileList(const char* list_name, char delimiter)
+{
+	FILE* list = fopen(list_name, "r");
+	char* line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	struct stat s;
+
+	if(list == NULL) {
+		return;
+	}
+	while(!is_stopped && ((len = getdelim(&line, &line_size, delimiter, list)) > 0)) {
+		if(line[len - 1] == delimiter) {
+			line[--len] = '\0';
+		}
+		if((len > 0) && (stat(line, &s) == 0) && S_ISREG(s.st_mode) && FILTER_IsFileAccepted(line, &s)) {
+			addTotal(s.st_size);
+		}
+	}
+	free(line);
+	fclose(list);
+}
+
+static void addTotal(int64_t size)
+{
+	__atomic_add_fetch(&total_files, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&total_bytes, size, __ATOMIC_RELAXED);
+}
+
+/* The rate is smoothed over the last few updates. */
+static void* displayMain(void* data)
+{
+	int64_t last_time = getTime();
+	int64_t last_bytes = 0;
+	int64_t time, bytes;
+	double rate = -1;
+	struct timespec wake_time;
+	char line[512];
+	char is_final;
+
+	pthread_mutex_lock(&lock);
+	do {
+		if(!is_stopped) {
+			clock_gettime(CLOCK_REALTIME, &wake_time);
+			wake_time.tv_sec += UPDATE_INTERVAL / 1000;
+			pthread_cond_timedwait(&stop_cond, &lock, &wake_time);
+		}
+		time = getTime();
+		bytes = __atomic_load_n(&done_bytes, __ATOMIC_RELAXED);
+		if(time > last_time) {
+			if(rate < 0) {
+				rate = (bytes - last_bytes) * 1000.0 / (time - last_time);
+			} else {
+				rate = 0.7 * rate + 0.3 * (bytes - last_bytes) * 1000.0 / (time - last_time);
+			}
+		}
+		last_time = time;
+		last_bytes = bytes;
+		/* Workers take the lock to set the current file, so they must not
+		   wait for the terminal. */
+		is_final = is_stopped;
+		formatStatus(line, sizeof(line), rate, is_final);
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "\r%s\033[K%s", line, is_final ? "\n" : "");
+		fflush(stderr);
+		pthread_mutex_lock(&lock);
+	} while(!is_final);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* Formats the status line, shortening the file name from the start to
+   fit the terminal. Called under the lock. */
+static void formatStatus(char* line, int size, double rate, char is_final)
+{
+	char done_size[32], all_size[32], rate_size[32];
+	int64_t bytes = __atomic_load_n(&done_bytes, __ATOMIC_RELAXED);
+	int64_t files = __atomic_load_n(&done_files, __ATOMIC_RELAXED);
+	int64_t all_bytes = __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+	int64_t all_files = __atomic_load_n(&total_files, __ATOMIC_RELAXED);
+	int64_t eta;
+	int width = getLineWidth();
+	int len, name_len;
+
+	formatSize(done_size, sizeof(done_size), bytes);
+	formatSize(all_size, sizeof(all_size), all_bytes);
+	formatSize(rate_size, sizeof(rate_size), (rate > 0) ? rate : 0);
+	if(is_scan_done && is_total_known) {
+		len = snprintf(line, size, "%5.1f%% %s / %s, %lld / %lld files, %s/s",
+		               (all_bytes > 0) ? 100.0 * bytes / all_bytes : 100.0, done_size, all_size,
+		               (long long)files, (long long)all_files, rate_size);
+		if((rate > 0) && (all_bytes > bytes) && !is_final) {
+			eta = (all_bytes - bytes) / rate;
+			len += snprintf(line + len, size - len, ", ETA %lld:%02d:%02d",
+			                (long long)(eta / 3600), (int)(eta / 60 % 60), (int)(eta % 60));
+		}
+	} else if(is_total_known) {
+		len = snprintf(line, size, "%s, %lld files, %s/s (scanning: %s in %lld files so far)",
+		               done_size, (long long)files, rate_size, all_size, (long long)all_files);
+	} else {
+		len = snprintf(line, size, "%s, %lld files, %s/s", done_size, (long long)files, rate_size);
+	}
+	if(len >= width - 1) {
+		len = width - 1;
+		line[len] = '\0';
+	}
+	name_len = strlen(current_file);
+	if(!is_final && (name_len > 0) && (len + 8 < width)) {
+		if(name_len > width - len - 3) {
+			snprintf(line + len, size - len, " ...%.*s", width - len - 6, current_file + name_len - (width - len - 6));
+		} else {
+			snprintf(line + len, size - len, " %.*s", width - len - 2, current_file);
+		}
+	}
+}
+
+static void formatSize(char* buffer, int size, double bytes)
+{
+	static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+	int i = 0;
+	while((bytes >= 1024) && (i < 5)) {
+		bytes /= 1024;
+		++i;
+	}
+	snprintf(buffer, size, (i == 0) ? "%.0f %s" : "%.1f %s", bytes, units[i]);
+}
+
+static int getLineWidth()
+{
+	struct winsize w;
+	if((ioctl(STDERR_FILENO, TIOCGWINSZ, &w) == 0) && (w.ws_col > 0)) {
+		return (w.ws_col < 512) ? w.ws_col : 512;
+	}
+	return DEFAULT_LINE_WIDTH;
+}
+
+static int64_t getTime()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
@@ -0,0 +1,449 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "crypt.h"
+#include "fedi.h"
+#include "filter.h"
+#include "progress.h"
+#include "sched.h"
+#include "settings.h"
+#include "topo.h"
+#include "trace.h"
+#include "visit.h"
+
+/* Number of files a queue may hold once its workers are running. */
+#define STREAM_QUEUE_SIZE 1024
+#define NAMES_ARENA_SIZE 65536
+#define MIN_NAME_CAPACITY 256
+
+/* Names live in the arena of their queue. Taking a file swaps the
+   buffers of the slot and the worker, so once the ring has gone round,
+   names are copied into buffers which are already there, and a new one
+   is taken from the arena only for a longer name. */
+typedef struct File
+{
+	char* name;
+	int name_capacity;
+	off_t size;
+	ino_t inode;
+} File;
+
+/* All files found on one device, stored as a ring buffer. Queues
+   filled before SCHED_Run grow freely and get sorted so that the
+   biggest files go first. Once the workers of a queue are started,
+   adding a file waits until there is space for it. Inodes being
+   processed are kept, so a file named twice is never processed by two
+   workers at once. */
+typedef struct Queue
+{
+	dev_t device;
+	int node;
+	File* files;
+	Arena names;
+	int files_num;
+	int files_capacity;
+	int first_file;
+	char is_started;
+	pthread_t* threads;
+	ino_t* busy_inodes;
+	int busy_num;
+	pthread_mutex_t lock;
+	pthread_cond_t has_files;
+	pthread_cond_t has_space;
+} Queue;
+
+static Settings* settings = NULL;
+static Queue** queues = NULL;
+static int queues_num = 0;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int is_finished = 0;
+static volatile int is_failed = 0;
+static volatile int is_stopped = 0;
+
+static void clearQueues();
+static void setFailed();
+static Queue* getQueue(dev_t device);
+static void startQueue(Queue* queue);
+static void resizeQueue(Queue* queue, int capacity);
+static void addFile(Queue* queue, const char* file_name, const struct stat* s);
+static int takeFile(Queue* queue, File* file);
+static int isInodeBusy(Queue* queue, ino_t inode);
+static int compareFiles(const void* a, const void* b);
+static void* workerMain(void* data);
+static int callback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf);
+
+void SCHED_Init(Settings* _settings)
+{
+	settings = _settings;
+}
+
+void SCHED_Quit()
+{
+	clearQueues();
+}
+
+void SCHED_AddPath(char* path)
+{
+	nftw(path, callback, 16, FTW_ACTIONRETVAL);
+}
+
+/* Files from the list are handed to the workers right away, so the
+   list is never kept in memory. */
+int SCHED_AddFileList(char* list_name, char delimiter)
+{
+	FILE* list = NULL;
+	char* line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	struct stat s;
+	Queue* queue = NULL;
+	int result;
+
+	if(strcmp(list_name, "-") == 0) {
+		list = stdin;
+	} else {
+		list = fopen(list_name, "r");
+	}
+	if(list == NULL) {
+		fprintf(stderr, "Failed to open file list %s\n", list_name);
+		return -1;
+	}
+	while(!is_failed && ((len = getdelim(&line, &line_size, delimiter, list)) > 0)) {
+		if(line[len - 1] == delimiter) {
+			line[--len] = '\0';
+		}
+		if(len == 0) {
+			continue;
+		}
+		TRACE_Begin("stat", line);
+		result = stat(line, &s);
+		TRACE_End("stat", 0, result);
+		if(result != 0) {
+			fprintf(stderr, "Failed to stat %s\n", line);
+			if(!settings->is_ignore_errors) {
+				setFailed();
+			}
+			continue;
+		}
+		if(S_ISREG(s.st_mode) && FILTER_IsFileAccepted(line, &s)
+		   && (VISIT_File(line, &s, VISIT_LISTED) == VISIT_NEW)) {
+			queue = getQueue(s.st_dev);
+			if(!queue->is_started) {
+				startQueue(queue);
+			}
+			addFile(queue, line, &s);
+		}
+	}
+	free(line);
+	if(list != stdin) {
+		fclose(list);
+	}
+	return is_failed ? -1 : 0;
+}
+
+/* Processes everything added so far and waits for it. The scheduler
+   can be filled and run again afterwards. */
+int SCHED_Run()
+{
+	int i, j, result;
+	Queue* queue = NULL;
+	for(i = 0; i < queues_num; ++i) {
+		queue = queues[i];
+		if(!queue->is_started) {
+			startQueue(queue);
+		}
+	}
+
+	for(i = 0; i < queues_num; ++i) {
+		queue = queues[i];
+		pthread_mutex_lock(&queue->lock);
+		is_finished = 1;
+		pthread_cond_broadcast(&queue->has_files);
+		pthread_mutex_unlock(&queue->lock);
+	}
+	for(i = 0; i < queues_num; ++i) {
+		for(j = 0; j < settings->jobs_per_device; ++j) {
+			pthread_join(queues[i]->threads[j], NULL);
+		}
+	}
+	result = is_failed ? -1 : 0;
+	VISIT_LinkFiles();
+	VISIT_Clear();
+	clearQueues();
+	is_finished = 0;
+	pthread_mutex_lock(&queues_lock);
+	is_failed = is_stopped;
+	pthread_mutex_unlock(&queues_lock);
+	return result;
+}
+
+/* Called from the signal thread. Workers and producers stop as after a
+   failure, and nothing is scheduled from then on. */
+void SCHED_Stop()
+{
+	is_stopped = 1;
+	setFailed();
+}
+
+static void clearQueues()
+{
+	int i;
+	Queue* queue = NULL;
+	pthread_mutex_lock(&queues_lock);
+	for(i = 0; i < queues_num; ++i) {
+		queue = queues[i];
+		free(queue->files);
+		ARENA_Quit(&queue->names);
+		free(queue->threads);
+		free(queue->busy_inodes);
+		pthread_mutex_destroy(&queue->lock);
+		pthread_cond_destroy(&queue->has_files);
+		pthread_cond_destroy(&queue->has_space);
+		free(queue);
+	}
+	free(queues);
+	queues = NULL;
+	queues_num = 0;
+	pthread_mutex_unlock(&queues_lock);
+}
+
+/* Wakes everyone waiting on any queue: workers stop taking files and a
+   producer blocked on a full queue of another device gives up. */
+static void setFailed()
+{
+	int i;
+	pthread_mutex_lock(&queues_lock);
+	is_failed = 1;
+	for(i = 0; i < queues_num; ++i) {
+		pthread_mutex_lock(&queues[i]->lock);
+		pthread_cond_broadcast(&queues[i]->has_files);
+		pthread_cond_broadcast(&queues[i]->has_space);
+		pthread_mutex_unlock(&queues[i]->lock);
+	}
+	pthread_mutex_unlock(&queues_lock);
+}
+
+static Queue* getQueue(dev_t device)
+{
+	int i;
+	Queue* queue = NULL;
+	for(i = 0; i < queues_num; ++i) {
+		if(queues[i]->device == device) {
+			return queues[i];
+		}
+	}
+	queue = (Queue*)malloc(sizeof(Queue));
+	queue->device = device;
+	queue->node = TOPO_GetDeviceNode(device);
+	queue->files = NULL;
+	ARENA_Init(&queue->names, NAMES_ARENA_SIZE);
+	queue->files_num = 0;
+	queue->files_capacity = 0;
+	queue->first_file = 0;
+	queue->is_started = 0;
+	queue->threads = NULL;
+	queue->busy_inodes = NULL;
+	queue->busy_num = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->has_files, NULL);
+	pthread_cond_init(&queue->has_space, NULL);
+	pthread_mutex_lock(&queues_lock);
+	queues = (Queue**)realloc(queues, sizeof(Queue*) * (queues_num + 1));
+	queues[queues_num++] = queue;
+	pthread_mutex_unlock(&queues_lock);
+	return queue;
+}
+
+static void startQueue(Queue* queue)
+{
+	int i;
+	qsort(queue->files, queue->files_num, sizeof(File), compareFiles);
+	if(queue->files_capacity < STREAM_QUEUE_SIZE) {
+		resizeQueue(queue, STREAM_QUEUE_SIZE);
+	}
+	queue->threads = (pthread_t*)malloc(sizeof(pthread_t) * settings->jobs_per_device);
+	queue->busy_inodes = (ino_t*)malloc(sizeof(ino_t) * settings->jobs_per_device);
+	queue->is_started = 1;
+	for(i = 0; i < settings->jobs_per_device; ++i) {
+		if(pthread_create(&queue->threads[i], NULL, workerMain, queue) != 0) {
+			fprintf(stderr, "Failed to start worker thread\n");
+			exit(-1);
+		}
+	}
+}
+
+/* Only called while the ring doesn't wrap: before the queue is started,
+   or when it is started and still holds the sorted files from 0. */
+static void resizeQueue(Queue* queue, int capacity)
+{
+	queue->files = (File*)realloc(queue->files, sizeof(File) * capacity);
+	memset(queue->files + queue->files_capacity, 0, sizeof(File) * (capacity - queue->files_capacity));
+	queue->files_capacity = capacity;
+}
+
+/* Files found before the queue is started are kept until it is sorted,
+   so their names are simply copied to the arena. Capacities of streaming
+   buffers are powers of two, so a slot gets only a few of them. */
+static void addFile(Queue* queue, const char* file_name, const struct stat* s)
+{
+	File* file = NULL;
+	int len = strlen(file_name) + 1;
+	pthread_mutex_lock(&queue->lock);
+	if(!queue->is_started && (queue->files_num == queue->files_capacity)) {
+		resizeQueue(queue, queue->files_capacity ? queue->files_capacity * 2 : 64);
+	}
+	while((queue->files_num == queue->files_capacity) && !is_failed) {
+		pthread_cond_wait(&queue->has_space, &queue->lock);
+	}
+	if(is_failed) {
+		pthread_mutex_unlock(&queue->lock);
+		return;
+	}
+	file = &queue->files[(queue->first_file + queue->files_num) % queue->files_capacity];
+	if(!queue->is_started) {
+		file->name = ARENA_Strdup(&queue->names, file_name);
+		file->name_capacity = len;
+	} else {
+		if(file->name_capacity < len) {
+			for(file->name_capacity = MIN_NAME_CAPACITY; file->name_capacity < len; file->name_capacity *= 2) {
+			}
+			file->name = (char*)ARENA_Alloc(&queue->names, file->name_capacity);
+		}
+		memcpy(file->name, file_name, len);
+	}
+	file->size = s->st_size;
+	file->inode = s->st_ino;
+	++queue->files_num;
+	pthread_cond_signal(&queue->has_files);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Returns 0 when there is nothing left to do. The previous name buffer
+   of the worker is left in the slot and its previous inode is released.
+   A file whose inode another worker has is dropped, that worker replaces
+   it anyway. */
+static int takeFile(Queue* queue, File* file)
+{
+	File* slot = NULL;
+	File taken;
+	int i;
+	int result = 0;
+	pthread_mutex_lock(&queue->lock);
+	for(i = 0; i < queue->busy_num; ++i) {
+		if(queue->busy_inodes[i] == file->inode) {
+			queue->busy_inodes[i] = queue->busy_inodes[--queue->busy_num];
+			break;
+		}
+	}
+	while(!result && !is_failed) {
+		while((queue->files_num == 0) && !is_finished && !is_failed) {
+			pthread_cond_wait(&queue->has_files, &queue->lock);
+		}
+		if((queue->files_num == 0) || is_failed) {
+			break;
+		}
+		slot = &queue->files[queue->first_file];
+		taken = *slot;
+		slot->name = file->name;
+		slot->name_capacity = file->name_capacity;
+		*file = taken;
+		queue->first_file = (queue->first_file + 1) % queue->files_capacity;
+		--queue->files_num;
+		pthread_cond_signal(&queue->has_space);
+		if(!isInodeBusy(queue, file->inode)) {
+			queue->busy_inodes[queue->busy_num++] = file->inode;
+			result = 1;
+		}
+	}
+	file->inode = result ? file->inode : 0;
+	pthread_mutex_unlock(&queue->lock);
+	return result;
+}
+
+static int compareFiles(const void* a, const void* b)
+{
+	off_t size_a = ((const File*)a)->size;
+	off_t size_b = ((const File*)b)->size;
+	if(size_a > size_b) {
+		return -1;
+	} else if(size_a < size_b) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static void* workerMain(void* data)
+{
+	Queue* queue = (Queue*)data;
+	State* state = NULL;
+	File file = {NULL, 0, 0, 0};
+	int result;
+	TOPO_BindWorker(queue->node);
+	state = FEDI_CreateState();
+	CRYPT_InitThread();
+	while(takeFile(queue, &file)) {
+		PROGRESS_StartFile(file.name);
+		result = FEDI_ProcessFile(state, file.name);
+		PROGRESS_EndFile(file.size);
+		if(result != 0) {
+			setFailed();
+		}
+	}
+	CRYPT_QuitThread();
+	/* Closing the state is traced too. */
+	FEDI_DestroyState(state);
+	TRACE_QuitThread();
+	return NULL;
+}
+
+/* Filters are checked here, before anything is opened, and excluded
+   or already walked directories are not walked at all. */
+static int callback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf)
+{
+	if(is_failed) {
+		return FTW_STOP;
+	}
+	if(type == FTW_D) {
+		if(FILTER_IsDirExcluded(file_name, s) || (VISIT_Dir(s) == VISIT_SEEN)) {
+			return FTW_SKIP_SUBTREE;
+		}
+	} else if((type == FTW_F) && FILTER_IsFileAccepted(file_name, s)
+	          && (VISIT_File(file_name, s, (ftw_buf->level == 0) ? VISIT_EXPLICIT : VISIT_WALKED) == VISIT_NEW)) {
+		addFile(getQueue(s->st_dev), file_name, s);
+	}
+	return FTW_CONTINUE;
+}
+
+static int isInodeBusy(Queue* queue, ino_t inode)
+{
+	int i;
+	for(i = 0; i < queue->busy_num; ++i) {
+		if(queue->busy_inodes[i] == inode) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -15,6 +15,9 @@
   along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
+
+#include "crypt.h"
 #include "settings.h"
 
 void SETTINGS_Init(Settings* settings)
@@ -25,6 +28,39 @@ void SETTINGS_Init(Settings* settings)
 	settings->is_key_set = 0;
 	settings->is_ignore_errors = 0;
 	settings->is_verbose = 0;
+	settings->is_rekey = 0;
+	settings->is_watch = 0;
+	settings->is_numa = 0;
+	settings->is_progress = 0;
+	settings->is_cipher_set = 0;
+	settings->is_cipher_auto = 0;
 	settings->random_level = 2;
+	settings->cipher = CRYPT_CIPHER_AES256_GCM;
+	settings->jobs_per_device = 1;
+	settings->cpus = NULL;
+	settings->trace_file = NULL;
+	settings->output_dir = NULL;
+	settings->chunks_dir = NULL;
+	settings->files_from = NULL;
+	settings->is_null_delimited = 0;
 	settings->key_len = 0;
+	settings->new_key_len = 0;
+	settings->include_patterns = NULL;
+	settings->include_patterns_num = 0;
+	settings->exclude_patterns = NULL;
+	settings->exclude_patterns_num = 0;
+	settings->min_size = -1;
+	settings->max_size = -1;
+	settings->min_mtime = -1;
+	settings->max_mtime = -1;
+}
+
+void SETTINGS_Quit(Settings* settings)
+{
+	free(settings->include_patterns);
+	free(settings->exclude_patterns);
+	settings->include_patterns = NULL;
+	settings->include_patterns_num = 0;
+	settings->exclude_patterns = NULL;
+	settings->exclude_patterns_num = 0;
 }
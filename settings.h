@@ -30,11 +30,36 @@ typedef struct Settings
 	char is_key_set;
 	char is_ignore_errors;
 	char is_verbose;
+	char is_rekey;
+	char is_watch;
+	char is_numa;
+	char is_progress;
+	char is_cipher_set;
+	char is_cipher_auto;
 	unsigned char random_level;
+	int cipher;
+	int jobs_per_device;
+	char* cpus;
+	char* trace_file;
+	char* output_dir;
+	char* chunks_dir;
+	char* files_from;
+	char is_null_delimited;
+	char** include_patterns;
+	int include_patterns_num;
+	char** exclude_patterns;
+	int exclude_patterns_num;
+	int64_t min_size;
+	int64_t max_size;
+	int64_t min_mtime;
+	int64_t max_mtime;
 	uint8_t key[MAX_KEY_LENGTH + 1];
 	int key_len;
+	uint8_t new_key[MAX_KEY_LENGTH + 1];
+	int new_key_len;
 } Settings;
 
 void SETTINGS_Init(Settings* settings);
+void SETTINGS_Quit(Settings* settings);
 
 #endif
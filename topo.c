@@ -0,0 +1,208 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+
+#include "settings.h"
+#include "topo.h"
+
+#define MAX_NODES 64
+
+/* CPUs allowed for workers, as a whole and split by NUMA node. Workers
+   are spread over the CPUs of their node round-robin. */
+typedef struct CpuList
+{
+	int* cpus;
+	int cpus_num;
+	int next_cpu;
+} CpuList;
+
+static Settings* settings = NULL;
+static CpuList all_cpus = {NULL, 0, 0};
+static CpuList node_cpus[MAX_NODES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int parseCpuList(const char* s, cpu_set_t* set);
+static int readCpuList(const char* path, cpu_set_t* set);
+static void fillCpuList(CpuList* list, const cpu_set_t* set);
+
+void TOPO_Init(Settings* _settings)
+{
+	cpu_set_t allowed, node_set;
+	char path[64];
+	int i;
+	settings = _settings;
+	memset(node_cpus, 0, sizeof(node_cpus));
+
+	if(settings->cpus != NULL) {
+		if(parseCpuList(settings->cpus, &allowed) != 0) {
+			fprintf(stderr, "Invalid CPU list: %s\n", settings->cpus);
+			exit(-1);
+		}
+	} else if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+	}
+	fillCpuList(&all_cpus, &allowed);
+
+	if(settings->is_numa) {
+		for(i = 0; i < MAX_NODES; ++i) {
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+			if(readCpuList(path, &node_set) == 0) {
+				CPU_AND(&node_set, &node_set, &allowed);
+				fillCpuList(&node_cpus[i], &node_set);
+			}
+		}
+	}
+}
+
+void TOPO_Quit()
+{
+	int i;
+	free(all_cpus.cpus);
+	all_cpus.cpus = NULL;
+	all_cpus.cpus_num = 0;
+	for(i = 0; i < MAX_NODES; ++i) {
+		free(node_cpus[i].cpus);
+		node_cpus[i].cpus = NULL;
+		node_cpus[i].cpus_num = 0;
+	}
+}
+
+/* The node of the PCI device behind a block device, -1 if unknown. For
+   partitions and NVMe namespaces it is found further up the tree. */
+int TOPO_GetDeviceNode(dev_t device)
+{
+	static const char* suffixes[] = {
+		"device/numa_node",
+		"device/device/numa_node",
+		"../device/numa_node",
+		"../device/device/numa_node"
+	};
+	char path[128];
+	FILE* file = NULL;
+	int i, node = -1;
+	if(!settings->is_numa) {
+		return -1;
+	}
+	for(i = 0; (i < sizeof(suffixes) / sizeof(suffixes[0])) && (node < 0); ++i) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(device), minor(device), suffixes[i]);
+		file = fopen(path, "r");
+		if(file != NULL) {
+			if(fscanf(file, "%d", &node) != 1) {
+				node = -1;
+			}
+			fclose(file);
+		}
+	}
+	return ((node >= 0) && (node < MAX_NODES)) ? node : -1;
+}
+
+/* Pins the calling thread. Without --cpus and --numa threads are left
+   to the system scheduler. */
+void TOPO_BindWorker(int node)
+{
+	CpuList* list = &all_cpus;
+	cpu_set_t set;
+	int cpu;
+	if((settings->cpus == NULL) && !settings->is_numa) {
+		return;
+	}
+	if((node >= 0) && (node_cpus[node].cpus_num > 0)) {
+		list = &node_cpus[node];
+	}
+	if(list->cpus_num == 0) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	cpu = list->cpus[list->next_cpu];
+	list->next_cpu = (list->next_cpu + 1) % list->cpus_num;
+	pthread_mutex_unlock(&lock);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Parses lists like "0-3,8,10-11". */
+static int parseCpuList(const char* s, cpu_set_t* set)
+{
+	char* end = NULL;
+	long first, last;
+	CPU_ZERO(set);
+	while(*s != '\0') {
+		first = strtol(s, &end, 10);
+		if((end == s) || (first < 0)) {
+			return -1;
+		}
+		last = first;
+		s = end;
+		if(*s == '-') {
+			++s;
+			last = strtol(s, &end, 10);
+			if((end == s) || (last < first)) {
+				return -1;
+			}
+			s = end;
+		}
+		if(last >= CPU_SETSIZE) {
+			return -1;
+		}
+		for(; first <= last; ++first) {
+			CPU_SET(first, set);
+		}
+		if(*s == ',') {
+			++s;
+		} else if((*s != '\0') && (*s != '\n')) {
+			return -1;
+		} else {
+			break;
+		}
+	}
+	return 0;
+}
+
+static int readCpuList(const char* path, cpu_set_t* set)
+{
+	char line[4096];
+	FILE* file = fopen(path, "r");
+	int result = -1;
+	if(file == NULL) {
+		return -1;
+	}
+	if(fgets(line, sizeof(line), file) != NULL) {
+		result = parseCpuList(line, set);
+	}
+	fclose(file);
+	return result;
+}
+
+static void fillCpuList(CpuList* list, const cpu_set_t* set)
+{
+	int i;
+	list->cpus = (int*)malloc(sizeof(int) * (CPU_COUNT(set) + 1));
+	list->cpus_num = 0;
+	list->next_cpu = 0;
+	for(i = 0; i < CPU_SETSIZE; ++i) {
+		if(CPU_ISSET(i, set)) {
+			list->cpus[list->cpus_num++] = i;
+		}
+	}
+}
@@ -0,0 +1,31 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TOPO_H
+#define TOPO_H
+
+#include <sys/types.h>
+
+typedef struct Settings Settings;
+
+void TOPO_Init(Settings* settings);
+void TOPO_Quit();
+
+int TOPO_GetDeviceNode(dev_t device);
+void TOPO_BindWorker(int node);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define EVENTS_BUFFER_SIZE 4096
+
+/* Events are collected by every thread in its own buffer and written
+   in Chrome trace format only when the buffer is full or the thread
+   is done, so tracing takes no locks on the hot path. */
+typedef struct Event
+{
+	char phase;
+	const char* name;
+	char* file_name;
+	int64_t time;
+	int64_t bytes;
+	int result;
+} Event;
+
+static FILE* trace_file = NULL;
+static int is_first_event = 1;
+static struct timespec start_time;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Event* events = NULL;
+static __thread int events_num = 0;
+static __thread long thread_id = 0;
+
+static void flushThread();
+static int64_t getTime();
+static Event* addEvent(char phase, const char* name);
+static void writeString(const char* s);
+
+void TRACE_Init(const char* path)
+{
+	trace_file = fopen(path, "w");
+	if(trace_file == NULL) {
+		fprintf(stderr, "Failed to open trace file %s\n", path);
+		exit(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	fputs("[\n", trace_file);
+}
+
+void TRACE_Quit()
+{
+	if(trace_file == NULL) {
+		return;
+	}
+	TRACE_QuitThread();
+	pthread_mutex_lock(&lock);
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&lock);
+}
+
+void TRACE_Begin(const char* name, const char* file_name)
+{
+	Event* event = NULL;
+	if(trace_file == NULL) {
+		return;
+	}
+	event = addEvent('B', name);
+	event->file_name = (file_name != NULL) ? strdup(file_name) : NULL;
+}
+
+void TRACE_End(const char* name, int64_t bytes, int result)
+{
+	Event* event = NULL;
+	if(trace_file == NULL) {
+		return;
+	}
+	event = addEvent('E', name);
+	event->bytes = bytes;
+	event->result = result;
+}
+
+void TRACE_QuitThread()
+{
+	flushThread();
+	free(events);
+	events = NULL;
+}
+
+static void flushThread()
+{
+	int i;
+	Event* event = NULL;
+	if((trace_file == NULL) || (events_num == 0)) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	for(i = 0; (trace_file != NULL) && (i < events_num); ++i) {
+		event = &events[i];
+		fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"file\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%ld,\"ts\":%lld",
+		        is_first_event ? "" : ",\n", event->name, event->phase, (int)getpid(), thread_id, (long long)event->time);
+		if(event->phase == 'B') {
+			if(event->file_name != NULL) {
+				fputs(",\"args\":{\"file\":", trace_file);
+				writeString(event->file_name);
+				fputc('}', trace_file);
+			}
+		} else {
+			fprintf(trace_file, ",\"args\":{\"bytes\":%lld,\"result\":%d}", (long long)event->bytes, event->result);
+		}
+		fputc('}', trace_file);
+		is_first_event = 0;
+		free(event->file_name);
+	}
+	pthread_mutex_unlock(&lock);
+	events_num = 0;
+}
+
+static int64_t getTime()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)(t.tv_sec - start_time.tv_sec) * 1000000 + (t.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+static Event* addEvent(char phase, const char* name)
+{
+	Event* event = NULL;
+	if(events == NULL) {
+		events = (Event*)malloc(sizeof(Event) * EVENTS_BUFFER_SIZE);
+		thread_id = syscall(SYS_gettid);
+	}
+	if(events_num == EVENTS_BUFFER_SIZE) {
+		flushThread();
+	}
+	event = &events[events_num++];
+	event->phase = phase;
+	event->name = name;
+	event->file_name = NULL;
+	event->time = getTime();
+	event->bytes = 0;
+	event->result = 0;
+	return event;
+}
+
+static void writeString(const char* s)
+{
+	fputc('"', trace_file);
+	for(; *s != '\0'; ++s) {
+		if((*s == '"') || (*s == '\\')) {
+			fputc('\\', trace_file);
+			fputc(*s, trace_file);
+		} else if((unsigned char)*s < 0x20) {
+			fprintf(trace_file, "\\u%04x", (unsigned char)*s);
+		} else {
+			fputc(*s, trace_file);
+		}
+	}
+	fputc('"', trace_file);
+}
@@ -60,3 +60,20 @@ int TTY_IsCaptured()
 {
 	return (tty != -1);
 }
+
+int TTY_ReadKey(uint8_t* key, int max_len)
+{
+	int len = 1;
+	struct termios s;
+	TTY_Capture(&s);
+	s.c_lflag &= ~ECHO;
+	TTY_SetState(&s);
+	while(len == 1) {
+		printf("\rKey: ");
+		fflush(stdout);
+		len = read(tty, key, max_len);
+	}
+	TTY_Release();
+	printf("\n");
+	return len - 1;
+}
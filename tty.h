@@ -18,6 +18,7 @@
 #ifndef TTY_H
 #define TTY_H
 
+#include <stdint.h>
 #include <termios.h>
 
 extern int tty;
@@ -26,5 +27,6 @@ void TTY_SetState(struct termios* state);
 void TTY_Capture(struct termios* state);
 void TTY_Release();
 int TTY_IsCaptured();
+int TTY_ReadKey(uint8_t* key, int max_len);
 
 #endif
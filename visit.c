@@ -0,0 +1,247 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "settings.h"
+#include "visit.h"
+
+#define MIN_CAPACITY 1024
+
+/* Only directories, files with several links and files given on the
+   command line are remembered, so memory depends on them rather than on
+   the number of files in the tree or in the --files-from list. */
+typedef struct Inode
+{
+	dev_t device;
+	ino_t inode;
+	char is_used;
+	char* path;
+} Inode;
+
+/* Another name of an inode which is processed through its first name. */
+typedef struct Link
+{
+	char* path;
+	char* target;
+	dev_t device;
+	ino_t inode;
+} Link;
+
+static Settings* settings = NULL;
+static Inode* inodes = NULL;
+static size_t inodes_num = 0;
+static size_t inodes_capacity = 0;
+static int dirs_num = 0;
+static Link* links = NULL;
+static int links_num = 0;
+static int links_capacity = 0;
+
+static size_t hashInode(dev_t device, ino_t inode);
+static Inode* findInode(dev_t device, ino_t inode);
+static Inode* addInode(dev_t device, ino_t inode, const char* path);
+static int isParentVisited(const char* path);
+
+void VISIT_Init(Settings* _settings)
+{
+	settings = _settings;
+}
+
+void VISIT_Quit()
+{
+	VISIT_Clear();
+}
+
+int VISIT_Dir(const struct stat* s)
+{
+	if(findInode(s->st_dev, s->st_ino) != NULL) {
+		return VISIT_SEEN;
+	}
+	addInode(s->st_dev, s->st_ino, NULL);
+	++dirs_num;
+	return VISIT_NEW;
+}
+
+/* Names from --files-from are checked against the walked directories
+   but not remembered, so a name repeated in the list is processed again. */
+int VISIT_File(const char* path, const struct stat* s, int origin)
+{
+	Inode* inode = findInode(s->st_dev, s->st_ino);
+	Link* file_link = NULL;
+	if(inode != NULL) {
+		if(inode->path == NULL) {
+			return VISIT_SEEN;
+		}
+		if(strcmp(inode->path, path) == 0) {
+			return VISIT_SEEN;
+		}
+		if(settings->output_dir != NULL) {
+			/* Sources are not replaced, each name gets its own result. */
+			return VISIT_NEW;
+		}
+		if(links_num == links_capacity) {
+			links_capacity = links_capacity ? links_capacity * 2 : 64;
+			links = (Link*)realloc(links, sizeof(Link) * links_capacity);
+		}
+		file_link = &links[links_num++];
+		file_link->path = strdup(path);
+		file_link->target = strdup(inode->path);
+		file_link->device = s->st_dev;
+		file_link->inode = s->st_ino;
+		return VISIT_LINK;
+	}
+	if((origin != VISIT_WALKED) && isParentVisited(path)) {
+		return VISIT_SEEN;
+	}
+	if(s->st_nlink > 1) {
+		addInode(s->st_dev, s->st_ino, path);
+	} else if(origin == VISIT_EXPLICIT) {
+		addInode(s->st_dev, s->st_ino, NULL);
+	}
+	return VISIT_NEW;
+}
+
+/* Processing replaces a file with a new inode, which other names of
+   the old inode should point to as well. If the inode didn't change,
+   the file was not replaced and its other names are left alone. */
+void VISIT_LinkFiles()
+{
+	int i;
+	struct stat s;
+	char* tmp_path = NULL;
+	Link* file_link = NULL;
+	for(i = 0; i < links_num; ++i) {
+		file_link = &links[i];
+		if((stat(file_link->target, &s) != 0)
+		   || ((s.st_dev == file_link->device) && (s.st_ino == file_link->inode))) {
+			continue;
+		}
+		tmp_path = (char*)malloc(strlen(file_link->path) + 2);
+		strcpy(tmp_path, file_link->path);
+		strcat(tmp_path, "~");
+		if((link(file_link->target, tmp_path) != 0) || (rename(tmp_path, file_link->path) != 0)) {
+			fprintf(stderr, "Failed to link %s to %s\n", file_link->path, file_link->target);
+			remove(tmp_path);
+		} else if(settings->is_verbose) {
+			printf("Linking: %s - ok!\n", file_link->path);
+		}
+		free(tmp_path);
+	}
+}
+
+void VISIT_Clear()
+{
+	size_t i;
+	int j;
+	for(i = 0; i < inodes_capacity; ++i) {
+		free(inodes[i].path);
+	}
+	free(inodes);
+	inodes = NULL;
+	inodes_num = 0;
+	inodes_capacity = 0;
+	dirs_num = 0;
+	for(j = 0; j < links_num; ++j) {
+		free(links[j].path);
+		free(links[j].target);
+	}
+	free(links);
+	links = NULL;
+	links_num = 0;
+	links_capacity = 0;
+}
+
+static size_t hashInode(dev_t device, ino_t inode)
+{
+	uint64_t hash = (uint64_t)inode * 0x9E3779B97F4A7C15ull;
+	hash ^= (uint64_t)device + 0x632BE59BD9B4E019ull + (hash << 6) + (hash >> 2);
+	return (size_t)(hash ^ (hash >> 29));
+}
+
+static Inode* findInode(dev_t device, ino_t inode)
+{
+	size_t i;
+	if(inodes_capacity == 0) {
+		return NULL;
+	}
+	i = hashInode(device, inode) & (inodes_capacity - 1);
+	while(inodes[i].is_used) {
+		if((inodes[i].inode == inode) && (inodes[i].device == device)) {
+			return &inodes[i];
+		}
+		i = (i + 1) & (inodes_capacity - 1);
+	}
+	return NULL;
+}
+
+static Inode* addInode(dev_t device, ino_t inode, const char* path)
+{
+	size_t i;
+	Inode* old_inodes = inodes;
+	size_t old_capacity = inodes_capacity;
+	if((inodes_num + 1) * 4 > inodes_capacity * 3) {
+		inodes_capacity = inodes_capacity ? inodes_capacity * 2 : MIN_CAPACITY;
+		inodes = (Inode*)calloc(inodes_capacity, sizeof(Inode));
+		inodes_num = 0;
+		for(i = 0; i < old_capacity; ++i) {
+			if(old_inodes[i].is_used) {
+				*addInode(old_inodes[i].device, old_inodes[i].inode, NULL) = old_inodes[i];
+			}
+		}
+		free(old_inodes);
+	}
+	i = hashInode(device, inode) & (inodes_capacity - 1);
+	while(inodes[i].is_used) {
+		i = (i + 1) & (inodes_capacity - 1);
+	}
+	inodes[i].device = device;
+	inodes[i].inode = inode;
+	inodes[i].is_used = 1;
+	inodes[i].path = (path != NULL) ? strdup(path) : NULL;
+	++inodes_num;
+	return &inodes[i];
+}
+
+/* A file given by name was already processed if its directory was walked. */
+static int isParentVisited(const char* path)
+{
+	struct stat s;
+	char* dir_path = NULL;
+	char* slash = NULL;
+	int result = 0;
+	if(dirs_num == 0) {
+		return 0;
+	}
+	dir_path = strdup(path);
+	slash = strrchr(dir_path, '/');
+	if(slash == NULL) {
+		strcpy(dir_path, ".");
+	} else if(slash == dir_path) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	if(stat(dir_path, &s) == 0) {
+		result = (findInode(s.st_dev, s.st_ino) != NULL);
+	}
+	free(dir_path);
+	return result;
+}
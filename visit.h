@@ -0,0 +1,48 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VISIT_H
+#define VISIT_H
+
+#include <sys/stat.h>
+
+typedef struct Settings Settings;
+
+enum
+{
+	VISIT_NEW,
+	VISIT_SEEN,
+	VISIT_LINK
+};
+
+/* Where a file name came from. */
+enum
+{
+	VISIT_WALKED,
+	VISIT_EXPLICIT,
+	VISIT_LISTED
+};
+
+void VISIT_Init(Settings* settings);
+void VISIT_Quit();
+
+int VISIT_Dir(const struct stat* s);
+int VISIT_File(const char* path, const struct stat* s, int origin);
+void VISIT_LinkFiles();
+void VISIT_Clear();
+
+#endif
@@ -0,0 +1,435 @@
+/*
+  This file is part of Dircrypt
+
+  Dircrypt is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Dircrypt is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Dircrypt.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "filter.h"
+#include "sched.h"
+#include "settings.h"
+#include "watch.h"
+
+/* inotify can't limit IN_CREATE to directories, it is kept only to see
+   new ones and is ignored for files. */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+/* A batch starts after this much time without new events... */
+#define DEBOUNCE_TIME 1000
+/* ...but never later than this after its first event. */
+#define MAX_BATCH_DELAY 10000
+#define MAX_BATCH_SIZE 4096
+#define TABLE_SIZE 4096
+#define EVENT_BUFFER_SIZE 65536
+
+/* Known files. A pending entry waits for the next batch. Once a file
+   is processed, the signature of the result is kept until the event
+   caused by our own rename comes back, so that the file is not
+   processed again. */
+typedef struct Entry
+{
+	char* path;
+	char is_pending;
+	char has_signature;
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+	struct Entry* next;
+} Entry;
+
+static Settings* settings = NULL;
+static int inotify_fd = -1;
+/* WATCH_Stop writes to it to wake the loop. */
+static int stop_pipe[2] = {-1, -1};
+static volatile int is_stopped = 0;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** watch_paths = NULL;
+static int watch_paths_num = 0;
+static char** roots = NULL;
+static int roots_num = 0;
+static Entry* table[TABLE_SIZE];
+static int pending_num = 0;
+static char is_adding_files = 0;
+static char is_overflowed = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t getTime();
+static uint32_t hashPath(const char* path);
+static Entry* getEntry(const char* path);
+static void removeEntry(Entry** it);
+static void setSignature(Entry* entry, const struct stat* s);
+static int hasSignature(const Entry* entry, const struct stat* s);
+static void markPending(const char* path);
+static int addTree(const char* path);
+static void rescan();
+static void handleEvent(const struct inotify_event* event);
+static int processBatch();
+static int callback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf);
+
+void WATCH_Init(Settings* _settings)
+{
+	settings = _settings;
+	memset(table, 0, sizeof(table));
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if(inotify_fd < 0) {
+		perror("Failed to initialize inotify");
+		exit(-1);
+	}
+	if(pipe2(stop_pipe, O_CLOEXEC) != 0) {
+		perror("Failed to create pipe");
+		exit(-1);
+	}
+}
+
+void WATCH_Quit()
+{
+	int i;
+	Entry** it = NULL;
+	for(i = 0; i < watch_paths_num; ++i) {
+		free(watch_paths[i]);
+	}
+	free(watch_paths);
+	watch_paths = NULL;
+	watch_paths_num = 0;
+	for(i = 0; i < roots_num; ++i) {
+		free(roots[i]);
+	}
+	free(roots);
+	roots = NULL;
+	roots_num = 0;
+	for(i = 0; i < TABLE_SIZE; ++i) {
+		it = &table[i];
+		while(*it != NULL) {
+			removeEntry(it);
+		}
+	}
+	pending_num = 0;
+	is_overflowed = 0;
+	if(inotify_fd >= 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	pthread_mutex_lock(&stop_lock);
+	for(i = 0; i < 2; ++i) {
+		if(stop_pipe[i] >= 0) {
+			close(stop_pipe[i]);
+			stop_pipe[i] = -1;
+		}
+	}
+	pthread_mutex_unlock(&stop_lock);
+}
+
+/* Watches the directory and all its subdirectories except excluded
+   ones. Files given directly are not watched. The path is kept to be
+   scanned again if events are lost. */
+int WATCH_AddPath(char* path)
+{
+	roots = (char**)realloc(roots, sizeof(char*) * (roots_num + 1));
+	roots[roots_num++] = strdup(path);
+	return addTree(path);
+}
+
+/* Called by workers right after they rename a result into place. The
+   main thread only touches the table while no workers are running, so
+   the lock is needed just between workers. */
+void WATCH_SetSignature(const char* path, const struct stat* s)
+{
+	if(inotify_fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&table_lock);
+	setSignature(getEntry(path), s);
+	pthread_mutex_unlock(&table_lock);
+}
+
+int WATCH_Run()
+{
+	char buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd poll_fds[2] = {{.fd = inotify_fd, .events = POLLIN}, {.fd = stop_pipe[0], .events = POLLIN}};
+	const struct inotify_event* event = NULL;
+	int64_t batch_start = 0;
+	int64_t timeout, now;
+	ssize_t len;
+	char* p = NULL;
+	int result;
+
+	is_adding_files = 1;
+	while(!is_stopped) {
+		timeout = -1;
+		if(pending_num > 0) {
+			now = getTime();
+			timeout = batch_start + MAX_BATCH_DELAY - now;
+			if(timeout > DEBOUNCE_TIME) {
+				timeout = DEBOUNCE_TIME;
+			} else if(timeout < 0) {
+				timeout = 0;
+			}
+		}
+		result = poll(poll_fds, 2, timeout);
+		if((result < 0) && (errno != EINTR)) {
+			perror("Failed to wait for events");
+			return -1;
+		}
+		if(is_stopped) {
+			break;
+		}
+		if((result > 0) && (poll_fds[0].revents & POLLIN)) {
+			len = read(inotify_fd, buffer, sizeof(buffer));
+			if((len < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+				perror("Failed to read events");
+				return -1;
+			}
+			for(p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+				event = (const struct inotify_event*)p;
+				if((pending_num == 0) && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE))) {
+					batch_start = getTime();
+				}
+				handleEvent(event);
+			}
+		}
+		if(is_overflowed) {
+			if(pending_num == 0) {
+				batch_start = getTime();
+			}
+			rescan();
+		}
+		if((pending_num > 0)
+		   && ((result == 0) || (pending_num >= MAX_BATCH_SIZE) || (getTime() - batch_start >= MAX_BATCH_DELAY))) {
+			if((processBatch() != 0) && !settings->is_ignore_errors) {
+				return -1;
+			}
+		}
+	}
+	return is_stopped ? -1 : 0;
+}
+
+/* Called from the signal thread, possibly while the loop waits. */
+void WATCH_Stop()
+{
+	char c = 0;
+	pthread_mutex_lock(&stop_lock);
+	is_stopped = 1;
+	if(stop_pipe[1] >= 0) {
+		if(write(stop_pipe[1], &c, 1) != 1) {
+			perror("Failed to stop watching");
+		}
+	}
+	pthread_mutex_unlock(&stop_lock);
+}
+
+static int64_t getTime()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static uint32_t hashPath(const char* path)
+{
+	uint32_t hash = 2166136261u;
+	while(*path) {
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	}
+	return hash;
+}
+
+static Entry* getEntry(const char* path)
+{
+	Entry** bucket = &table[hashPath(path) % TABLE_SIZE];
+	Entry* entry = NULL;
+	for(entry = *bucket; entry != NULL; entry = entry->next) {
+		if(strcmp(entry->path, path) == 0) {
+			return entry;
+		}
+	}
+	entry = (Entry*)malloc(sizeof(Entry));
+	entry->path = strdup(path);
+	entry->is_pending = 0;
+	entry->has_signature = 0;
+	entry->next = *bucket;
+	*bucket = entry;
+	return entry;
+}
+
+static void removeEntry(Entry** it)
+{
+	Entry* entry = *it;
+	*it = entry->next;
+	free(entry->path);
+	free(entry);
+}
+
+static void setSignature(Entry* entry, const struct stat* s)
+{
+	entry->has_signature = 1;
+	entry->device = s->st_dev;
+	entry->inode = s->st_ino;
+	entry->size = s->st_size;
+	entry->mtime = s->st_mtim;
+}
+
+static int hasSignature(const Entry* entry, const struct stat* s)
+{
+	return entry->has_signature
+		&& (entry->device == s->st_dev) && (entry->inode == s->st_ino)
+		&& (entry->size == s->st_size)
+		&& (entry->mtime.tv_sec == s->st_mtim.tv_sec)
+		&& (entry->mtime.tv_nsec == s->st_mtim.tv_nsec);
+}
+
+static void markPending(const char* path)
+{
+	Entry* entry = getEntry(path);
+	if(!entry->is_pending) {
+		entry->is_pending = 1;
+		++pending_num;
+	}
+}
+
+static int addTree(const char* path)
+{
+	return nftw(path, callback, 16, FTW_ACTIONRETVAL);
+}
+
+/* After lost events nothing is known about the tree, so every file in
+   it goes to the next batch. Known entries are marked as well: those
+   whose file is gone are dropped with their signatures, and our own
+   results are recognized by theirs. */
+static void rescan()
+{
+	int i;
+	Entry* entry = NULL;
+	fprintf(stderr, "Too many events, scanning the watched directories again\n");
+	is_overflowed = 0;
+	for(i = 0; i < TABLE_SIZE; ++i) {
+		for(entry = table[i]; entry != NULL; entry = entry->next) {
+			markPending(entry->path);
+		}
+	}
+	for(i = 0; i < roots_num; ++i) {
+		addTree(roots[i]);
+	}
+}
+
+static void handleEvent(const struct inotify_event* event)
+{
+	char* dir_path = NULL;
+	char* path = NULL;
+	if(event->mask & IN_Q_OVERFLOW) {
+		is_overflowed = 1;
+		return;
+	}
+	if((event->wd < 0) || (event->wd >= watch_paths_num) || (watch_paths[event->wd] == NULL)) {
+		return;
+	}
+	if(event->mask & IN_IGNORED) {
+		free(watch_paths[event->wd]);
+		watch_paths[event->wd] = NULL;
+		return;
+	}
+	if(event->len == 0) {
+		return;
+	}
+	dir_path = watch_paths[event->wd];
+	path = (char*)malloc(strlen(dir_path) + event->len + 2);
+	strcpy(path, dir_path);
+	if(path[strlen(path) - 1] != '/') {
+		strcat(path, "/");
+	}
+	strcat(path, event->name);
+	if(event->mask & IN_ISDIR) {
+		if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			addTree(path);
+		}
+	} else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		markPending(path);
+	}
+	free(path);
+}
+
+/* Temporary files are gone by the time the batch starts and renamed
+   results still carry the signature recorded by the worker, so neither
+   is processed again. A file rewritten after our rename no longer
+   matches it and goes to the next batch. */
+static int processBatch()
+{
+	int i, result;
+	Entry** it = NULL;
+	Entry* entry = NULL;
+	struct stat s;
+
+	for(i = 0; i < TABLE_SIZE; ++i) {
+		it = &table[i];
+		while(*it != NULL) {
+			entry = *it;
+			if(entry->is_pending) {
+				entry->is_pending = 0;
+				if((stat(entry->path, &s) != 0) || !S_ISREG(s.st_mode)
+				   || hasSignature(entry, &s) || !FILTER_IsFileAccepted(entry->path, &s)) {
+					removeEntry(it);
+					continue;
+				}
+				entry->is_pending = 1;
+				SCHED_AddPath(entry->path);
+			}
+			it = &entry->next;
+		}
+	}
+	result = SCHED_Run();
+
+	for(i = 0; i < TABLE_SIZE; ++i) {
+		for(entry = table[i]; entry != NULL; entry = entry->next) {
+			entry->is_pending = 0;
+		}
+	}
+	pending_num = 0;
+	return result;
+}
+
+static int callback(const char *file_name, const struct stat *s, int type, struct FTW* ftw_buf)
+{
+	int wd;
+	if(type == FTW_D) {
+		if(FILTER_IsDirExcluded(file_name, s)) {
+			return FTW_SKIP_SUBTREE;
+		}
+		wd = inotify_add_watch(inotify_fd, file_name, WATCH_MASK);
+		if(wd < 0) {
+			fprintf(stderr, "Failed to watch %s\n", file_name);
+			return FTW_CONTINUE;
+		}
+		if(wd >= watch_paths_num) {
+			watch_paths = (char**)realloc(watch_paths, sizeof(char*) * (wd + 1));
+			memset(watch_paths + watch_paths_num, 0, sizeof(char*) * (wd + 1 - watch_paths_num));
+			watch_paths_num = wd + 1;
+		}
+		free(watch_paths[wd]);
+		watch_paths[wd] = strdup(file_name);
+	} else if((type == FTW_F) && is_adding_files) {
+		markPending(file_name);
+	}
+	return FTW_CONTINUE;
+}